@@ -90,6 +90,10 @@
 #include <linux/usb/input.h>
 #include <linux/power_supply.h>
 #include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <linux/jhash.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
 #ifdef WACOM_LINUX_UNALIGNED
 #include <linux/unaligned.h>
 #else
@@ -97,6 +101,12 @@
 #endif
 #include <linux/version.h>
 
+#ifdef WACOM_BIN_ATTR_CONST
+#define WACOM_BIN_ATTR const struct bin_attribute
+#else
+#define WACOM_BIN_ATTR struct bin_attribute
+#endif
+
 /*
  * Version Information
  */
@@ -158,6 +168,9 @@ struct wacom_battery {
 	int bat_charging;
 	int bat_connected;
 	int ps_connected;
+	int notified_capacity;		/* capacity at the last uevent */
+	unsigned long notified_at;	/* jiffies of the last uevent */
+	struct delayed_work notify_work;
 };
 
 struct wacom_remote {
@@ -168,26 +181,37 @@ struct wacom_remote {
 		struct attribute_group group;
 		u32 serial;
 		struct input_dev *input;
+		struct input_dev __rcu *active;	/* input, once registered */
+		u32 buttons;
 		bool registered;
 		struct wacom_battery battery;
 		ktime_t active_time;
 	} remotes[WACOM_MAX_REMOTES];
+	unsigned int last_index;	/* index of the last remote reporting */
+	struct wacom_remote_work_data last_status;	/* last queued snapshot */
 };
 
 struct wacom {
+	struct wacom_wac wacom_wac;	/* must stay first, see wacom_check_layout() */
+	struct hid_device *hdev;
 	struct usb_device *usbdev;
 	struct usb_interface *intf;
-	struct wacom_wac wacom_wac;
-	struct hid_device *hdev;
 	struct mutex lock;
 	struct work_struct wireless_work;
+	struct delayed_work wireless_release_work;
 	struct work_struct battery_work;
 	struct work_struct remote_work;
 	struct delayed_work init_work;
 	struct delayed_work aes_battery_work;
 	struct wacom_remote *remote;
 	struct work_struct mode_change_work;
+	struct delayed_work led_work;
+	struct work_struct oled_work;
+	struct list_head cmd_queue;	/* outgoing reports, see wacom_sys.c */
+	spinlock_t cmd_lock;
+	struct work_struct cmd_work;
 	struct timer_list idleprox_timer;
+	unsigned long idleprox_last;	/* jiffies of last in-range report */
 	bool generic_has_leds;
 	struct wacom_leds {
 		struct wacom_group_leds *groups;
@@ -197,30 +221,104 @@ struct wacom {
 		u8 img_lum;   /* OLED matrix display brightness */
 		u8 max_llv;   /* maximum brightness of LED (llv) */
 		u8 max_hlv;   /* maximum brightness of LED (hlv) */
+		u32 applied;  /* hash of the last LED report sent, 0 if unknown */
+		u32 queued;   /* hash of the last LED report queued, 0 if unknown */
+		u8 *frame;    /* staged OLED button images */
+		unsigned long img_pending; /* images waiting for upload */
+		u32 img_hash[8]; /* hash of each uploaded image, 0 if unknown */
+		struct bin_attribute rawimg_attr; /* wacom_led_rawimg, sized for the bus */
+		WACOM_BIN_ATTR *oled_bin_attrs[2];
+		struct attribute_group oled_group;
 	} led;
 	struct wacom_battery battery;
 	bool resources;
+	bool removing;		/* wacom_remove() started, don't queue work */
+	DECLARE_BITMAP(feature_reports_read, HID_MAX_IDS); /* during parse */
+	u32 feature_key;	/* feature report cache key, see wacom_sys.c */
+	struct dentry *debugfs;
+	struct wacom_stats {
+		u32 feature_cache_hits;
+		u32 feature_cache_misses;
+		u32 work_delay_max_us;
+		u32 resume_us;
+		u32 battery_notify_suppressed;
+	} stats;
+	ktime_t work_queued[WACOM_WORKER_MODE_CHANGE + 1];
 };
 
+extern struct workqueue_struct *wacom_wq;
+
+/*
+ * Work that changes the set of input devices or their state goes on the
+ * driver's own high priority queue. Battery bookkeeping, LED and OLED
+ * updates and other output reports aren't urgent and use
+ * system_power_efficient_wq.
+ */
 static inline void wacom_schedule_work(struct wacom_wac *wacom_wac,
 				       enum wacom_worker which)
 {
 	struct wacom *wacom = container_of(wacom_wac, struct wacom, wacom_wac);
+	struct workqueue_struct *wq = wacom_wq;
+	struct work_struct *work;
 
 	switch (which) {
 	case WACOM_WORKER_WIRELESS:
-		schedule_work(&wacom->wireless_work);
+		work = &wacom->wireless_work;
 		break;
 	case WACOM_WORKER_BATTERY:
-		schedule_work(&wacom->battery_work);
+		work = &wacom->battery_work;
+		wq = system_power_efficient_wq;
 		break;
 	case WACOM_WORKER_REMOTE:
-		schedule_work(&wacom->remote_work);
+		work = &wacom->remote_work;
 		break;
 	case WACOM_WORKER_MODE_CHANGE:
-		schedule_work(&wacom->mode_change_work);
+		work = &wacom->mode_change_work;
 		break;
+	default:
+		return;
 	}
+
+	if (!work_pending(work))
+		wacom->work_queued[which] = ktime_get();
+	queue_work(wq, work);
+}
+
+/*
+ * Keep the per-report fields of struct wacom_wac, including the leading
+ * members of its features, within the first two 64-byte cache lines of
+ * struct wacom. The generic HID parser state follows them, ahead of the
+ * names and the LED/battery/remote bookkeeping. Fails the build if a new
+ * field pushes them apart.
+ */
+static inline void wacom_check_layout(void)
+{
+#define WACOM_CHECK_HOT(member) \
+	BUILD_BUG_ON(offsetofend(struct wacom_wac, member) > 128)
+
+	BUILD_BUG_ON(offsetof(struct wacom, wacom_wac) != 0);
+	WACOM_CHECK_HOT(data);
+	WACOM_CHECK_HOT(shared);
+	WACOM_CHECK_HOT(pen_input);
+	WACOM_CHECK_HOT(touch_input);
+	WACOM_CHECK_HOT(pad_input);
+	WACOM_CHECK_HOT(tool);
+	WACOM_CHECK_HOT(id);
+	WACOM_CHECK_HOT(serial);
+	WACOM_CHECK_HOT(pad_buttons);
+	WACOM_CHECK_HOT(probe_complete);
+	WACOM_CHECK_HOT(reporting_data);
+	WACOM_CHECK_HOT(is_invalid_bt_frame);
+	WACOM_CHECK_HOT(num_contacts_left);
+	WACOM_CHECK_HOT(features.x_max);
+	WACOM_CHECK_HOT(features.y_max);
+	WACOM_CHECK_HOT(features.pressure_max);
+	WACOM_CHECK_HOT(features.distance_max);
+	WACOM_CHECK_HOT(features.type);
+	WACOM_CHECK_HOT(features.numbered_buttons);
+	BUILD_BUG_ON(offsetof(struct wacom_wac, twist_xform) >
+		     offsetof(struct wacom_wac, name));
+#undef WACOM_CHECK_HOT
 }
 
 /*
@@ -254,6 +352,7 @@ void wacom_wac_event(struct hid_device *hdev, struct hid_field *field,
 		struct hid_usage *usage, __s32 value);
 void wacom_wac_report(struct hid_device *hdev, struct hid_report *report);
 void wacom_battery_work(struct work_struct *work);
+void wacom_battery_notify_work(struct work_struct *work);
 enum led_brightness wacom_leds_brightness_get(struct wacom_led *led);
 struct wacom_led *wacom_led_find(struct wacom *wacom, unsigned int group,
 				 unsigned int id);
@@ -261,4 +360,5 @@ struct wacom_led *wacom_led_next(struct wacom *wacom, struct wacom_led *cur);
 int wacom_equivalent_usage(int usage);
 int wacom_initialize_leds(struct wacom *wacom);
 void wacom_idleprox_timeout(struct timer_list *list);
+void wacom_work_started(struct wacom *wacom, enum wacom_worker which);
 #endif
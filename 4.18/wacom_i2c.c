@@ -14,6 +14,11 @@
 #include <linux/slab.h>
 #include <linux/irq.h>
 #include <linux/interrupt.h>
+#include <linux/hrtimer.h>
+#include <linux/debugfs.h>
+#include <linux/pm_runtime.h>
+#include <linux/property.h>
+#include <linux/workqueue.h>
 #ifdef WACOM_LINUX_UNALIGNED
 #include <linux/unaligned.h>
 #else
@@ -74,6 +79,22 @@
 
 #define DISTANCE_MAX		255
 
+#define WACOM_I2C_MAX_DRAIN	8	/* reports read per interrupt at most */
+
+#define OPCODE_SET_POWER	0x08
+#define POWER_ON		0x00
+#define POWER_SLEEP		0x01
+
+#define WACOM_I2C_POLL_FAST_US	5000	/* poll period with the pen in proximity */
+#define WACOM_I2C_POLL_SLOW_US	50000	/* poll period otherwise */
+#define WACOM_I2C_AUTOSUSPEND_MS	2000
+
+static bool poll;
+module_param(poll, bool, 0444);
+MODULE_PARM_DESC(poll, " poll the digitizer instead of using its interrupt line");
+
+static struct dentry *wacom_i2c_debugfs_root;
+
 struct feature_support {
 	bool distance;
 	bool tilt;
@@ -95,6 +116,15 @@ struct wacom_i2c {
 	struct input_dev *input;
 	struct wacom_features features;
 	u8 data[WACOM_QUERY_SIZE];
+	unsigned int read_len;
+	ktime_t irq_time;
+	u32 irq_latency_max_us;
+	struct dentry *debugfs;
+	bool polling;
+	bool running;
+	bool poll_armed;
+	struct hrtimer poll_timer;
+	struct work_struct poll_work;
 	bool prox;
 	int tool;
 };
@@ -165,9 +195,70 @@ static int wacom_query_device(struct i2c_client *client,
 	return 0;
 }
 
-static irqreturn_t wacom_i2c_irq(int irq, void *dev_id)
+/*
+ * Only read as much as the generation's pen report needs: G9 and earlier
+ * send MAX_LEN_BG9 bytes, G12 parts with their single byte hover height
+ * MAX_LEN_G12, and later ones MAX_LEN_AG14.
+ */
+static unsigned int wacom_i2c_read_len(struct wacom_features *features)
+{
+	if (!features->support.distance && !features->support.tilt)
+		return MAX_LEN_BG9;
+
+	if (features->distance_max == DISTANCE_MAX)
+		return MAX_LEN_G12;
+
+	return MAX_LEN_AG14;
+}
+
+static int wacom_i2c_read_report(struct wacom_i2c *wac_i2c)
+{
+	struct i2c_client *client = wac_i2c->client;
+	u8 *data = wac_i2c->data;
+	int error;
+
+	error = i2c_master_recv(client, data, wac_i2c->read_len);
+	if (error < 0)
+		return error;
+
+	/*
+	 * The first byte holds the report length; if the controller sends
+	 * more than we expected, read whole reports from now on. The tail of
+	 * this one was never read, so drop it rather than report stale
+	 * tilt and height bytes.
+	 */
+	if (data[0] > wac_i2c->read_len) {
+		dev_dbg(&client->dev, "report length %d, expected %d\n",
+			data[0], wac_i2c->read_len);
+		wac_i2c->read_len = min_t(unsigned int, data[0],
+					  sizeof(wac_i2c->data));
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+/*
+ * Is the interrupt line still asserted? Only a level triggered line
+ * tells us that more reports are waiting; an edge triggered one idles
+ * at whatever level it was left at.
+ */
+static bool wacom_i2c_irq_pending(int irq)
+{
+	unsigned int trigger = irq_get_trigger_type(irq);
+	bool high;
+
+	if (!(trigger & IRQ_TYPE_LEVEL_MASK))
+		return false;
+
+	if (irq_get_irqchip_state(irq, IRQCHIP_STATE_LINE_LEVEL, &high))
+		return false;
+
+	return (trigger & IRQ_TYPE_LEVEL_HIGH) ? high : !high;
+}
+
+static void wacom_i2c_report(struct wacom_i2c *wac_i2c)
 {
-	struct wacom_i2c *wac_i2c = dev_id;
 	struct input_dev *input = wac_i2c->input;
 	struct wacom_features *features = &wac_i2c->features;
 	u8 *data = wac_i2c->data;
@@ -175,12 +266,6 @@ static irqreturn_t wacom_i2c_irq(int irq, void *dev_id)
 	unsigned char tsw, f1, f2, ers;
 	short tilt_x, tilt_y;
 	short distance = 0;
-	int error;
-
-	error = i2c_master_recv(wac_i2c->client,
-				wac_i2c->data, sizeof(wac_i2c->data));
-	if (error < 0)
-		goto out;
 
 	tsw = data[3] & WACOM_TIP_SWITCH;
 	ers = data[3] & WACOM_ERASER;
@@ -221,17 +306,154 @@ static irqreturn_t wacom_i2c_irq(int irq, void *dev_id)
 	input_report_abs(input, ABS_Y, y);
 	input_report_abs(input, ABS_PRESSURE, pressure);
 	input_sync(input);
+}
+
+/* Note when the sample was taken, before the thread gets to read it */
+static irqreturn_t wacom_i2c_hard_irq(int irq, void *dev_id)
+{
+	struct wacom_i2c *wac_i2c = dev_id;
+
+	wac_i2c->irq_time = ktime_get();
+
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t wacom_i2c_irq(int irq, void *dev_id)
+{
+	struct wacom_i2c *wac_i2c = dev_id;
+	s64 latency;
+	int error, i;
+
+	if (wacom_i2c_read_report(wac_i2c))
+		goto out;
+
+#ifdef WACOM_INPUT_SET_TIMESTAMP
+	input_set_timestamp(wac_i2c->input, wac_i2c->irq_time);
+#endif
+	wacom_i2c_report(wac_i2c);
+
+	latency = ktime_us_delta(ktime_get(), wac_i2c->irq_time);
+	if (latency > READ_ONCE(wac_i2c->irq_latency_max_us))
+		WRITE_ONCE(wac_i2c->irq_latency_max_us,
+			   min_t(s64, latency, U32_MAX));
+
+	/* drain the reports that queued up while we were busy */
+	for (i = 1; i < WACOM_I2C_MAX_DRAIN && wacom_i2c_irq_pending(irq); i++) {
+		error = wacom_i2c_read_report(wac_i2c);
+		if (error == -EAGAIN)
+			continue;
+		if (error)
+			break;
+		if (wac_i2c->data[0] < MAX_LEN_BG9)
+			break;
+		wacom_i2c_report(wac_i2c);
+	}
 
 out:
 	return IRQ_HANDLED;
 }
 
+/*
+ * Polling runs off a high resolution timer: a jiffies based delay would
+ * round the 5 ms period up to a whole tick, up to 10 ms at HZ=100. The
+ * timer only kicks the work, which does the (sleeping) I2C transfer.
+ */
+static ktime_t wacom_i2c_poll_period(struct wacom_i2c *wac_i2c)
+{
+	unsigned int period = READ_ONCE(wac_i2c->prox) ?
+			      WACOM_I2C_POLL_FAST_US : WACOM_I2C_POLL_SLOW_US;
+
+	return ns_to_ktime(period * NSEC_PER_USEC);
+}
+
+static enum hrtimer_restart wacom_i2c_poll_timer(struct hrtimer *timer)
+{
+	struct wacom_i2c *wac_i2c =
+		container_of(timer, struct wacom_i2c, poll_timer);
+
+	if (!READ_ONCE(wac_i2c->poll_armed))
+		return HRTIMER_NORESTART;
+
+	queue_work(system_highpri_wq, &wac_i2c->poll_work);
+	hrtimer_forward_now(timer, wacom_i2c_poll_period(wac_i2c));
+
+	return HRTIMER_RESTART;
+}
+
+static void wacom_i2c_poll(struct work_struct *work)
+{
+	struct wacom_i2c *wac_i2c =
+		container_of(work, struct wacom_i2c, poll_work);
+
+	/* an idle controller answers with an empty report */
+	if (!wacom_i2c_read_report(wac_i2c) &&
+	    wac_i2c->data[0] >= MAX_LEN_BG9)
+		wacom_i2c_report(wac_i2c);
+}
+
+static void wacom_i2c_poll_start(struct wacom_i2c *wac_i2c)
+{
+	WRITE_ONCE(wac_i2c->poll_armed, true);
+	hrtimer_start(&wac_i2c->poll_timer, wacom_i2c_poll_period(wac_i2c),
+		      HRTIMER_MODE_REL);
+}
+
+static void wacom_i2c_poll_stop(struct wacom_i2c *wac_i2c)
+{
+	WRITE_ONCE(wac_i2c->poll_armed, false);
+	hrtimer_cancel(&wac_i2c->poll_timer);
+	cancel_work_sync(&wac_i2c->poll_work);
+}
+
+static void wacom_i2c_start(struct wacom_i2c *wac_i2c)
+{
+	if (wac_i2c->polling)
+		wacom_i2c_poll_start(wac_i2c);
+	else
+		enable_irq(wac_i2c->client->irq);
+}
+
+static void wacom_i2c_stop(struct wacom_i2c *wac_i2c)
+{
+	if (wac_i2c->polling)
+		wacom_i2c_poll_stop(wac_i2c);
+	else
+		disable_irq(wac_i2c->client->irq);
+}
+
+static int wacom_i2c_set_power(struct i2c_client *client, u8 state)
+{
+	u8 cmd[] = {
+		WACOM_COMMAND_LSB,
+		WACOM_COMMAND_MSB,
+		state,
+		OPCODE_SET_POWER,
+	};
+	int ret;
+
+	ret = i2c_master_send(client, cmd, sizeof(cmd));
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(cmd))
+		return -EIO;
+
+	return 0;
+}
+
 static int wacom_i2c_open(struct input_dev *dev)
 {
 	struct wacom_i2c *wac_i2c = input_get_drvdata(dev);
 	struct i2c_client *client = wac_i2c->client;
+	int error;
+
+	error = pm_runtime_get_sync(&client->dev);
+	if (error < 0) {
+		pm_runtime_put_noidle(&client->dev);
+		return error;
+	}
 
-	enable_irq(client->irq);
+	WRITE_ONCE(wac_i2c->running, true);
+	wacom_i2c_start(wac_i2c);
 
 	return 0;
 }
@@ -241,7 +463,41 @@ static void wacom_i2c_close(struct input_dev *dev)
 	struct wacom_i2c *wac_i2c = input_get_drvdata(dev);
 	struct i2c_client *client = wac_i2c->client;
 
-	disable_irq(client->irq);
+	WRITE_ONCE(wac_i2c->running, false);
+	wacom_i2c_stop(wac_i2c);
+
+	pm_runtime_mark_last_busy(&client->dev);
+	pm_runtime_put_autosuspend(&client->dev);
+}
+
+static void wacom_i2c_debugfs_remove(void *data)
+{
+	struct wacom_i2c *wac_i2c = data;
+
+	debugfs_remove_recursive(wac_i2c->debugfs);
+}
+
+static int wacom_i2c_debugfs_init(struct wacom_i2c *wac_i2c)
+{
+	struct device *dev = &wac_i2c->client->dev;
+
+	wac_i2c->debugfs = debugfs_create_dir(dev_name(dev),
+					      wacom_i2c_debugfs_root);
+
+	/* longest time from interrupt to reported sample, write 0 to reset */
+	debugfs_create_u32("irq_latency_max_us", 0600, wac_i2c->debugfs,
+			   &wac_i2c->irq_latency_max_us);
+
+	return devm_add_action_or_reset(dev, wacom_i2c_debugfs_remove,
+					wac_i2c);
+}
+
+static void wacom_i2c_disable_pm(void *data)
+{
+	struct device *dev = data;
+
+	pm_runtime_dont_use_autosuspend(dev);
+	pm_runtime_disable(dev);
 }
 
 #ifdef WACOM_PROBE_LEGACY
@@ -272,6 +528,23 @@ static int wacom_i2c_probe(struct i2c_client *client)
 		return error;
 
 	wac_i2c->client = client;
+	i2c_set_clientdata(client, wac_i2c);
+
+	error = wacom_i2c_debugfs_init(wac_i2c);
+	if (error)
+		return error;
+
+	wac_i2c->read_len = wacom_i2c_read_len(features);
+	wac_i2c->polling = poll || client->irq <= 0 ||
+			   device_property_read_bool(dev, "wacom,poll");
+	INIT_WORK(&wac_i2c->poll_work, wacom_i2c_poll);
+#ifdef WACOM_HRTIMER_SETUP
+	hrtimer_setup(&wac_i2c->poll_timer, wacom_i2c_poll_timer,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&wac_i2c->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	wac_i2c->poll_timer.function = wacom_i2c_poll_timer;
+#endif
 
 	input = devm_input_allocate_device(dev);
 	if (!input)
@@ -319,15 +592,30 @@ static int wacom_i2c_probe(struct i2c_client *client)
 
 	input_set_drvdata(input, wac_i2c);
 
-	error = devm_request_threaded_irq(dev, client->irq, NULL, wacom_i2c_irq,
-					  IRQF_ONESHOT, "wacom_i2c", wac_i2c);
-	if (error) {
-		dev_err(dev, "Failed to request IRQ: %d\n", error);
-		return error;
+	if (wac_i2c->polling) {
+		dev_info(dev, "polling the digitizer\n");
+	} else {
+		error = devm_request_threaded_irq(dev, client->irq,
+						  wacom_i2c_hard_irq,
+						  wacom_i2c_irq, IRQF_ONESHOT,
+						  "wacom_i2c", wac_i2c);
+		if (error) {
+			dev_err(dev, "Failed to request IRQ: %d\n", error);
+			return error;
+		}
+
+		/* Disable the IRQ, we'll enable it in wac_i2c_open() */
+		disable_irq(client->irq);
 	}
 
-	/* Disable the IRQ, we'll enable it in wac_i2c_open() */
-	disable_irq(client->irq);
+	/* Let the controller sleep while nobody has the device open */
+	pm_runtime_set_active(dev);
+	pm_runtime_set_autosuspend_delay(dev, WACOM_I2C_AUTOSUSPEND_MS);
+	pm_runtime_use_autosuspend(dev);
+	pm_runtime_enable(dev);
+	error = devm_add_action_or_reset(dev, wacom_i2c_disable_pm, dev);
+	if (error)
+		return error;
 
 	error = input_register_device(wac_i2c->input);
 	if (error) {
@@ -341,8 +629,12 @@ static int wacom_i2c_probe(struct i2c_client *client)
 static int __maybe_unused wacom_i2c_suspend(struct device *dev)
 {
 	struct i2c_client *client = to_i2c_client(dev);
+	struct wacom_i2c *wac_i2c = i2c_get_clientdata(client);
 
-	disable_irq(client->irq);
+	if (wac_i2c->polling)
+		wacom_i2c_poll_stop(wac_i2c);
+	else
+		disable_irq(client->irq);
 
 	return 0;
 }
@@ -350,13 +642,48 @@ static int __maybe_unused wacom_i2c_suspend(struct device *dev)
 static int __maybe_unused wacom_i2c_resume(struct device *dev)
 {
 	struct i2c_client *client = to_i2c_client(dev);
+	struct wacom_i2c *wac_i2c = i2c_get_clientdata(client);
+
+	if (!wac_i2c->polling)
+		enable_irq(client->irq);
+	else if (READ_ONCE(wac_i2c->running))
+		wacom_i2c_poll_start(wac_i2c);
+
+	return 0;
+}
+
+/*
+ * Not every controller knows SET_POWER; one that ignores it simply stays
+ * awake, so don't fail the transition over it.
+ */
+static int __maybe_unused wacom_i2c_runtime_suspend(struct device *dev)
+{
+	int error;
 
-	enable_irq(client->irq);
+	error = wacom_i2c_set_power(to_i2c_client(dev), POWER_SLEEP);
+	if (error)
+		dev_dbg(dev, "failed to put the controller to sleep: %d\n",
+			error);
 
 	return 0;
 }
 
-static SIMPLE_DEV_PM_OPS(wacom_i2c_pm, wacom_i2c_suspend, wacom_i2c_resume);
+static int __maybe_unused wacom_i2c_runtime_resume(struct device *dev)
+{
+	int error;
+
+	error = wacom_i2c_set_power(to_i2c_client(dev), POWER_ON);
+	if (error)
+		dev_dbg(dev, "failed to wake the controller up: %d\n", error);
+
+	return 0;
+}
+
+static const struct dev_pm_ops wacom_i2c_pm = {
+	SET_SYSTEM_SLEEP_PM_OPS(wacom_i2c_suspend, wacom_i2c_resume)
+	SET_RUNTIME_PM_OPS(wacom_i2c_runtime_suspend,
+			   wacom_i2c_runtime_resume, NULL)
+};
 
 static const struct i2c_device_id wacom_i2c_id[] = {
 	{ "WAC_I2C_EMR", 0 },
@@ -386,7 +713,28 @@ static struct i2c_driver wacom_i2c_driver = {
 	.probe		= wacom_i2c_probe,
 	.id_table	= wacom_i2c_id,
 };
-module_i2c_driver(wacom_i2c_driver);
+
+static int __init wacom_i2c_init(void)
+{
+	int error;
+
+	wacom_i2c_debugfs_root = debugfs_create_dir("wacom_i2c", NULL);
+
+	error = i2c_add_driver(&wacom_i2c_driver);
+	if (error)
+		debugfs_remove_recursive(wacom_i2c_debugfs_root);
+
+	return error;
+}
+
+static void __exit wacom_i2c_exit(void)
+{
+	i2c_del_driver(&wacom_i2c_driver);
+	debugfs_remove_recursive(wacom_i2c_debugfs_root);
+}
+
+module_init(wacom_i2c_init);
+module_exit(wacom_i2c_exit);
 
 MODULE_AUTHOR("Tatsunosuke Tobita <tobita.tatsunosuke@wacom.co.jp>");
 MODULE_DESCRIPTION("WACOM EMR I2C Driver");
@@ -6,10 +6,24 @@
 #include "wacom_wac.h"
 #include "wacom.h"
 #include <linux/input/mt.h>
+#include <linux/debugfs.h>
 
 #define WAC_MSG_RETRIES		5
 #define WAC_CMD_RETRIES		10
 
+/* delay before the first retry of a busy request, doubled each time */
+#define WAC_RETRY_DELAY_MIN_US	500
+#define WAC_RETRY_DELAY_MAX_US	16000
+
+struct workqueue_struct *wacom_wq;
+
+/* /sys/kernel/debug/wacom, with one directory per device below it */
+static struct dentry *wacom_debugfs_root;
+
+static unsigned int wireless_linger = 2000;
+module_param(wireless_linger, uint, 0644);
+MODULE_PARM_DESC(wireless_linger, " ms to keep the input devices of a disconnected wireless tablet for a quick reconnect (0 disables)");
+
 #define DEV_ATTR_RW_PERM (S_IRUGO | S_IWUSR | S_IWGRP)
 #define DEV_ATTR_WO_PERM (S_IWUSR | S_IWGRP)
 #define DEV_ATTR_RO_PERM (S_IRUSR | S_IRGRP)
@@ -20,15 +34,38 @@
 #define wacom_is_using_usb_driver(hdev) hid_is_using_ll_driver(hdev, &usb_hid_driver)
 #endif
 
+void wacom_work_started(struct wacom *wacom, enum wacom_worker which)
+{
+	s64 delay = ktime_us_delta(ktime_get(), wacom->work_queued[which]);
+
+	if (delay > READ_ONCE(wacom->stats.work_delay_max_us))
+		WRITE_ONCE(wacom->stats.work_delay_max_us,
+			   min_t(s64, delay, U32_MAX));
+}
+
+static bool wacom_retry_backoff(int retval, unsigned int *retries,
+				unsigned int *delay)
+{
+	if ((retval != -ETIMEDOUT && retval != -EAGAIN) || !--*retries)
+		return false;
+
+	/* give a busy device some room instead of hammering it */
+	usleep_range(*delay, *delay * 2);
+	*delay = min(*delay * 2, (unsigned int)WAC_RETRY_DELAY_MAX_US);
+
+	return true;
+}
+
 static int wacom_get_report(struct hid_device *hdev, u8 type, u8 *buf,
 			    size_t size, unsigned int retries)
 {
+	unsigned int delay = WAC_RETRY_DELAY_MIN_US;
 	int retval;
 
 	do {
 		retval = hid_hw_raw_request(hdev, buf[0], buf, size, type,
 				HID_REQ_GET_REPORT);
-	} while ((retval == -ETIMEDOUT || retval == -EAGAIN) && --retries);
+	} while (wacom_retry_backoff(retval, &retries, &delay));
 
 	if (retval < 0)
 		hid_err(hdev, "wacom_get_report: ran out of retries "
@@ -40,12 +77,13 @@ static int wacom_get_report(struct hid_device *hdev, u8 type, u8 *buf,
 static int wacom_set_report(struct hid_device *hdev, u8 type, u8 *buf,
 			    size_t size, unsigned int retries)
 {
+	unsigned int delay = WAC_RETRY_DELAY_MIN_US;
 	int retval;
 
 	do {
 		retval = hid_hw_raw_request(hdev, buf[0], buf, size, type,
 				HID_REQ_SET_REPORT);
-	} while ((retval == -ETIMEDOUT || retval == -EAGAIN) && --retries);
+	} while (wacom_retry_backoff(retval, &retries, &delay));
 
 	if (retval < 0)
 		hid_err(hdev, "wacom_set_report: ran out of retries "
@@ -54,6 +92,98 @@ static int wacom_set_report(struct hid_device *hdev, u8 type, u8 *buf,
 	return retval;
 }
 
+/*
+ * Outgoing reports that nobody needs to wait for are queued and sent
+ * from a worker under wacom->lock. A queued report that has not been
+ * sent yet is replaced by a newer one with the same type and report ID
+ * since the device would only end up in the latter state anyway.
+ */
+struct wacom_cmd {
+	struct list_head list;
+	u8 type;
+	u32 led_hash;	/* LED state this report applies, 0 if none */
+	size_t size;
+	u8 buf[];
+};
+
+static void wacom_cmd_work(struct work_struct *work)
+{
+	struct wacom *wacom = container_of(work, struct wacom, cmd_work);
+	struct wacom_cmd *cmd;
+	int retval;
+
+	for (;;) {
+		spin_lock_irq(&wacom->cmd_lock);
+		cmd = list_first_entry_or_null(&wacom->cmd_queue,
+					       struct wacom_cmd, list);
+		if (cmd)
+			list_del(&cmd->list);
+		spin_unlock_irq(&wacom->cmd_lock);
+
+		if (!cmd)
+			break;
+
+		mutex_lock(&wacom->lock);
+		retval = wacom_set_report(wacom->hdev, cmd->type, cmd->buf,
+					  cmd->size, WAC_CMD_RETRIES);
+		/* the device may be left in any state, resend LEDs next time */
+		if (retval < 0) {
+			wacom->led.applied = 0;
+			wacom->led.queued = 0;
+		}
+		else if (cmd->led_hash)
+			wacom->led.applied = cmd->led_hash;
+		mutex_unlock(&wacom->lock);
+
+		kfree(cmd);
+	}
+}
+
+static int wacom_queue_report(struct wacom *wacom, u8 type, const u8 *buf,
+			      size_t size, u32 led_hash)
+{
+	struct wacom_cmd *cmd, *pending;
+	unsigned long flags;
+
+	cmd = kmalloc(struct_size(cmd, buf, size), GFP_KERNEL);
+	if (!cmd)
+		return -ENOMEM;
+
+	cmd->type = type;
+	cmd->led_hash = led_hash;
+	cmd->size = size;
+	memcpy(cmd->buf, buf, size);
+
+	spin_lock_irqsave(&wacom->cmd_lock, flags);
+	list_for_each_entry(pending, &wacom->cmd_queue, list) {
+		if (pending->type == type && pending->size == size &&
+		    pending->buf[0] == buf[0]) {
+			list_replace(&pending->list, &cmd->list);
+			spin_unlock_irqrestore(&wacom->cmd_lock, flags);
+			kfree(pending);
+			goto queued;
+		}
+	}
+	list_add_tail(&cmd->list, &wacom->cmd_queue);
+	spin_unlock_irqrestore(&wacom->cmd_lock, flags);
+
+queued:
+	queue_work(system_power_efficient_wq, &wacom->cmd_work);
+	return 0;
+}
+
+static void wacom_cancel_reports(struct wacom *wacom)
+{
+	struct wacom_cmd *cmd, *tmp;
+
+	cancel_work_sync(&wacom->cmd_work);
+
+	list_for_each_entry_safe(cmd, tmp, &wacom->cmd_queue, list) {
+		list_del(&cmd->list);
+		kfree(cmd);
+	}
+}
+
 static void wacom_wac_queue_insert(struct hid_device *hdev,
 				   struct kfifo_rec_ptr_2 *fifo,
 				   u8 *raw_data, int size)
@@ -310,6 +440,140 @@ static void wacom_hid_usage_quirk(struct hid_device *hdev,
 	}
 }
 
+/*
+ * Feature reports read while parsing (HID_DG_CONTACTMAX, sensor offsets)
+ * only depend on the tablet itself. Remember them per VID/PID and report
+ * descriptor, and serial where there is one, so that replugging the
+ * tablet, a mode change or a wireless reconnect doesn't repeat the USB
+ * round trips. Writing the feature_cache_flush parameter empties it.
+ */
+#define WACOM_FEATURE_CACHE_MAX	64
+
+struct wacom_feature_cache_entry {
+	struct list_head list;
+	u16 vendor;
+	u16 product;
+	u32 key;		/* hash of rdesc and uniq, to skip most compares */
+	char uniq[64];
+	unsigned int rsize;
+	u8 *rdesc;
+	u8 id;
+	int len;
+	u8 data[];
+};
+
+static LIST_HEAD(wacom_feature_cache);
+static DEFINE_MUTEX(wacom_feature_cache_lock);
+static unsigned int wacom_feature_cache_count;
+
+static void wacom_feature_cache_free(struct wacom_feature_cache_entry *entry)
+{
+	list_del(&entry->list);
+	kfree(entry->rdesc);
+	kfree(entry);
+}
+
+static void wacom_feature_cache_flush(void)
+{
+	struct wacom_feature_cache_entry *entry, *tmp;
+
+	mutex_lock(&wacom_feature_cache_lock);
+	list_for_each_entry_safe(entry, tmp, &wacom_feature_cache, list)
+		wacom_feature_cache_free(entry);
+	wacom_feature_cache_count = 0;
+	mutex_unlock(&wacom_feature_cache_lock);
+}
+
+static int wacom_feature_cache_set_flush(const char *val,
+					 const struct kernel_param *kp)
+{
+	wacom_feature_cache_flush();
+	return 0;
+}
+
+static const struct kernel_param_ops wacom_feature_cache_flush_ops = {
+	.set = wacom_feature_cache_set_flush,
+};
+module_param_cb(feature_cache_flush, &wacom_feature_cache_flush_ops, NULL, 0200);
+MODULE_PARM_DESC(feature_cache_flush, " write to drop all cached feature reports");
+
+static u32 wacom_feature_cache_key(struct hid_device *hdev)
+{
+	u32 key = jhash(hdev->rdesc, hdev->rsize, 0);
+
+	return jhash(hdev->uniq, strnlen(hdev->uniq, sizeof(hdev->uniq)), key);
+}
+
+static bool wacom_feature_cache_match(struct wacom_feature_cache_entry *entry,
+				      struct hid_device *hdev, u32 key)
+{
+	return entry->vendor == hdev->vendor &&
+	       entry->product == hdev->product &&
+	       entry->key == key &&
+	       entry->rsize == hdev->rsize &&
+	       !strncmp(entry->uniq, hdev->uniq, sizeof(entry->uniq)) &&
+	       !memcmp(entry->rdesc, hdev->rdesc, hdev->rsize);
+}
+
+static int wacom_get_feature_report(struct hid_device *hdev, u8 *data,
+				    size_t size)
+{
+	struct wacom *wacom = hid_get_drvdata(hdev);
+	struct wacom_feature_cache_entry *entry;
+	int ret;
+
+	mutex_lock(&wacom_feature_cache_lock);
+	list_for_each_entry(entry, &wacom_feature_cache, list) {
+		if (entry->id == data[0] && entry->len <= size &&
+		    wacom_feature_cache_match(entry, hdev, wacom->feature_key)) {
+			memcpy(data, entry->data, entry->len);
+			ret = entry->len;
+			wacom->stats.feature_cache_hits++;
+			mutex_unlock(&wacom_feature_cache_lock);
+			return ret;
+		}
+	}
+	wacom->stats.feature_cache_misses++;
+	mutex_unlock(&wacom_feature_cache_lock);
+
+	ret = wacom_get_report(hdev, HID_FEATURE_REPORT, data, size,
+			       WAC_CMD_RETRIES);
+	/* a short read says nothing about the tablet; don't keep it */
+	if (ret <= 0 || (size_t)ret != size)
+		return ret;
+
+	entry = kmalloc(struct_size(entry, data, ret), GFP_KERNEL);
+	if (!entry)
+		return ret;
+
+	entry->rdesc = kmemdup(hdev->rdesc, hdev->rsize, GFP_KERNEL);
+	if (!entry->rdesc) {
+		kfree(entry);
+		return ret;
+	}
+
+	entry->vendor = hdev->vendor;
+	entry->product = hdev->product;
+	entry->key = wacom->feature_key;
+	strscpy(entry->uniq, hdev->uniq, sizeof(entry->uniq));
+	entry->rsize = hdev->rsize;
+	entry->id = data[0];
+	entry->len = ret;
+	memcpy(entry->data, data, ret);
+
+	mutex_lock(&wacom_feature_cache_lock);
+	if (wacom_feature_cache_count == WACOM_FEATURE_CACHE_MAX) {
+		wacom_feature_cache_free(list_last_entry(&wacom_feature_cache,
+					 struct wacom_feature_cache_entry, list));
+		wacom_feature_cache_count--;
+	}
+	list_add(&entry->list, &wacom_feature_cache);
+	wacom_feature_cache_count++;
+	mutex_unlock(&wacom_feature_cache_lock);
+
+	return ret;
+}
+
 static void wacom_feature_mapping(struct hid_device *hdev,
 		struct hid_field *field, struct hid_usage *usage)
 {
@@ -336,8 +600,7 @@ static void wacom_feature_mapping(struct hid_device *hdev,
 			if (!data)
 				break;
 			data[0] = field->report->id;
-			ret = wacom_get_report(hdev, HID_FEATURE_REPORT,
-					       data, n, WAC_CMD_RETRIES);
+			ret = wacom_get_feature_report(hdev, data, n);
 			if (ret == n && features->type == HID_GENERIC) {
 				ret = hid_report_raw_event(hdev,
 					HID_FEATURE_REPORT, data, n, 0);
@@ -391,14 +654,22 @@ static void wacom_feature_mapping(struct hid_device *hdev,
 	case WACOM_HID_WD_OFFSETTOP:
 	case WACOM_HID_WD_OFFSETRIGHT:
 	case WACOM_HID_WD_OFFSETBOTTOM:
+		/*
+		 * All four offsets usually share one feature report and a
+		 * single read updates every one of them; don't fetch (or
+		 * retry) the same report once per usage.
+		 */
+		if (test_and_set_bit(field->report->id,
+				     wacom->feature_reports_read))
+			break;
+
 		/* read manually */
 		n = hid_report_len(field->report);
 		data = hid_alloc_report_buf(field->report, GFP_KERNEL);
 		if (!data)
 			break;
 		data[0] = field->report->id;
-		ret = wacom_get_report(hdev, HID_FEATURE_REPORT,
-					data, n, WAC_CMD_RETRIES);
+		ret = wacom_get_feature_report(hdev, data, n);
 		if (ret == n) {
 			ret = hid_report_raw_event(hdev, HID_FEATURE_REPORT,
 						   data, n, 0);
@@ -530,10 +801,14 @@ static void wacom_post_parse_hid(struct hid_device *hdev,
 static void wacom_parse_hid(struct hid_device *hdev,
 			   struct wacom_features *features)
 {
+	struct wacom *wacom = hid_get_drvdata(hdev);
 	struct hid_report_enum *rep_enum;
 	struct hid_report *hreport;
 	int i, j;
 
+	bitmap_zero(wacom->feature_reports_read, HID_MAX_IDS);
+	wacom->feature_key = wacom_feature_cache_key(hdev);
+
 	/* check features first */
 	rep_enum = &hdev->report_enum[HID_FEATURE_REPORT];
 	list_for_each_entry(hreport, &rep_enum->report_list, list) {
@@ -756,16 +1031,37 @@ static void wacom_retrieve_hid_descriptor(struct hid_device *hdev,
 	wacom_parse_hid(hdev, features);
 }
 
+/*
+ * Shared data of probed interfaces, indexed both by the device path
+ * (phys up to the last '/', shared by interfaces of one USB device) and
+ * by the parent path (up to the last '.', shared by USB devices behind
+ * one hub port). Any sibling candidate has to match one of the two, so
+ * lookups only walk a single bucket of each.
+ */
+#define WACOM_UDEV_HASH_BITS	4
+
 struct wacom_hdev_data {
-	struct list_head list;
+	struct hlist_node path_node;
+	struct hlist_node parent_node;
 	struct kref kref;
 	struct hid_device *dev;
 	struct wacom_shared shared;
 };
 
-static LIST_HEAD(wacom_udev_list);
+static DEFINE_HASHTABLE(wacom_udev_by_path, WACOM_UDEV_HASH_BITS);
+static DEFINE_HASHTABLE(wacom_udev_by_parent, WACOM_UDEV_HASH_BITS);
 static DEFINE_MUTEX(wacom_udev_list_lock);
 
+static u32 wacom_phys_hash(struct hid_device *hdev, char separator)
+{
+	const char *end = strrchr(hdev->phys, separator);
+
+	if (!end)
+		return 0;
+
+	return jhash(hdev->phys, end - hdev->phys, 0);
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,19,0)
 static bool compare_device_paths(struct hid_device *hdev_a,
 		struct hid_device *hdev_b, char separator)
@@ -851,9 +1147,11 @@ static bool wacom_are_sibling(struct hid_device *hdev,
 static struct wacom_hdev_data *wacom_get_hdev_data(struct hid_device *hdev)
 {
 	struct wacom_hdev_data *data;
+	u32 path = wacom_phys_hash(hdev, '/');
+	u32 parent = wacom_phys_hash(hdev, '.');
 
 	/* Try to find an already-probed interface from the same device */
-	list_for_each_entry(data, &wacom_udev_list, list) {
+	hash_for_each_possible(wacom_udev_by_path, data, path_node, path) {
 		if (compare_device_paths(hdev, data->dev, '/')) {
 			kref_get(&data->kref);
 			return data;
@@ -861,7 +1159,14 @@ static struct wacom_hdev_data *wacom_get_hdev_data(struct hid_device *hdev)
 	}
 
 	/* Fallback to finding devices that appear to be "siblings" */
-	list_for_each_entry(data, &wacom_udev_list, list) {
+	hash_for_each_possible(wacom_udev_by_path, data, path_node, path) {
+		if (wacom_are_sibling(hdev, data->dev)) {
+			kref_get(&data->kref);
+			return data;
+		}
+	}
+
+	hash_for_each_possible(wacom_udev_by_parent, data, parent_node, parent) {
 		if (wacom_are_sibling(hdev, data->dev)) {
 			kref_get(&data->kref);
 			return data;
@@ -872,12 +1177,13 @@ static struct wacom_hdev_data *wacom_get_hdev_data(struct hid_device *hdev)
 }
 
 static void wacom_release_shared_data(struct kref *kref)
+	__releases(&wacom_udev_list_lock)
 {
 	struct wacom_hdev_data *data =
 		container_of(kref, struct wacom_hdev_data, kref);
 
-	mutex_lock(&wacom_udev_list_lock);
-	list_del(&data->list);
+	hash_del(&data->path_node);
+	hash_del(&data->parent_node);
 	mutex_unlock(&wacom_udev_list_lock);
 
 	kfree(data);
@@ -898,7 +1204,8 @@ static void wacom_remove_shared_data(void *res)
 		else if (wacom_wac->shared->pen == wacom->hdev)
 			wacom_wac->shared->pen = NULL;
 
-		kref_put(&data->kref, wacom_release_shared_data);
+		kref_put_mutex(&data->kref, wacom_release_shared_data,
+			       &wacom_udev_list_lock);
 		wacom_wac->shared = NULL;
 	}
 }
@@ -922,7 +1229,10 @@ static int wacom_add_shared_data(struct hid_device *hdev)
 
 		kref_init(&data->kref);
 		data->dev = hdev;
-		list_add_tail(&data->list, &wacom_udev_list);
+		hash_add(wacom_udev_by_path, &data->path_node,
+			 wacom_phys_hash(hdev, '/'));
+		hash_add(wacom_udev_by_parent, &data->parent_node,
+			 wacom_phys_hash(hdev, '.'));
 	}
 
 	mutex_unlock(&wacom_udev_list_lock);
@@ -941,10 +1251,16 @@ static int wacom_add_shared_data(struct hid_device *hdev)
 	return retval;
 }
 
-static int wacom_led_control(struct wacom *wacom)
+/*
+ * Send the current LED state to the tablet. Unless resend is set, skip
+ * the round trip when it matches the last report queued: that one either
+ * went out already or will, since a later report would have replaced it.
+ */
+static int _wacom_led_control(struct wacom *wacom, bool resend)
 {
 	unsigned char *buf;
 	int retval;
+	u32 hash;
 	unsigned char report_id = WAC_CMD_LED_CONTROL;
 	int buf_size = 9;
 
@@ -1016,13 +1332,73 @@ static int wacom_led_control(struct wacom *wacom)
 		buf[4] = wacom->led.img_lum;
 	}
 
-	retval = wacom_set_report(wacom->hdev, HID_FEATURE_REPORT, buf, buf_size,
-				  WAC_CMD_RETRIES);
+	hash = jhash(buf, buf_size, buf_size) ?: 1;
+	if (!resend && hash == wacom->led.queued) {
+		kfree(buf);
+		return 0;
+	}
+
+	/* led.applied is only updated once the report went out */
+	retval = wacom_queue_report(wacom, HID_FEATURE_REPORT, buf, buf_size,
+				    hash);
+	if (!retval)
+		wacom->led.queued = hash;
 	kfree(buf);
 
 	return retval;
 }
 
+static int wacom_led_control(struct wacom *wacom)
+{
+	return _wacom_led_control(wacom, true);
+}
+
+/*
+ * LED state changes from sysfs and the LED class only update the cached
+ * state; a short delayed work then sends whatever the state is by then
+ * as a single report, so setting a whole LED profile costs one transfer.
+ */
+#define WACOM_LED_FLUSH_DELAY_MS	10
+
+static void wacom_led_work(struct work_struct *work)
+{
+	struct wacom *wacom = container_of(work, struct wacom, led_work.work);
+
+	mutex_lock(&wacom->lock);
+	_wacom_led_control(wacom, false);
+	mutex_unlock(&wacom->lock);
+}
+
+/* Called with wacom->lock held, except from resume */
+static void wacom_led_schedule(struct wacom *wacom, unsigned int delay_ms)
+{
+	if (wacom->removing)
+		return;
+
+	queue_delayed_work(system_power_efficient_wq, &wacom->led_work,
+			   msecs_to_jiffies(delay_ms));
+}
+
+/*
+ * Wait until the LED state has reached the device. Must not be called
+ * with wacom->lock held.
+ */
+static int wacom_led_sync(struct wacom *wacom)
+{
+	int error = 0;
+
+	flush_delayed_work(&wacom->led_work);
+	flush_work(&wacom->oled_work);
+	flush_work(&wacom->cmd_work);
+
+	mutex_lock(&wacom->lock);
+	if (wacom->led.groups && !wacom->led.applied)
+		error = -EIO;
+	mutex_unlock(&wacom->lock);
+
+	return error;
+}
+
 static int wacom_led_putimage(struct wacom *wacom, int button_id, u8 xfer_id,
 		const unsigned len, const void *img)
 {
@@ -1080,11 +1456,11 @@ static ssize_t wacom_led_select_store(struct device *dev, int set_id,
 	mutex_lock(&wacom->lock);
 
 	wacom->led.groups[set_id].select = id & 0x3;
-	err = wacom_led_control(wacom);
+	wacom_led_schedule(wacom, WACOM_LED_FLUSH_DELAY_MS);
 
 	mutex_unlock(&wacom->lock);
 
-	return err < 0 ? err : count;
+	return count;
 }
 
 #define DEVICE_LED_SELECT_ATTR(SET_ID)					\
@@ -1121,11 +1497,11 @@ static ssize_t wacom_luminance_store(struct wacom *wacom, u8 *dest,
 	mutex_lock(&wacom->lock);
 
 	*dest = value & 0x7f;
-	err = wacom_led_control(wacom);
+	wacom_led_schedule(wacom, WACOM_LED_FLUSH_DELAY_MS);
 
 	mutex_unlock(&wacom->lock);
 
-	return err < 0 ? err : count;
+	return count;
 }
 
 #define DEVICE_LUMINANCE_ATTR(name, field)				\
@@ -1148,10 +1524,35 @@ static DEVICE_ATTR(name##_luminance, DEV_ATTR_RW_PERM,			\
 		   wacom_##name##_luminance_show,			\
 		   wacom_##name##_luminance_store)
 
+static ssize_t wacom_led_sync_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct hid_device *hdev = to_hid_device(dev);
+	struct wacom *wacom = hid_get_drvdata(hdev);
+	int err;
+
+	err = wacom_led_sync(wacom);
+
+	return err < 0 ? err : count;
+}
+static DEVICE_ATTR(sync, DEV_ATTR_WO_PERM, NULL, wacom_led_sync_store);
+
 DEVICE_LUMINANCE_ATTR(status0, llv);
 DEVICE_LUMINANCE_ATTR(status1, hlv);
 DEVICE_LUMINANCE_ATTR(buttons, img_lum);
 
+static unsigned int wacom_led_image_format(struct hid_device *hdev,
+					   u8 *xfer_id)
+{
+	if (hdev->bus == BUS_BLUETOOTH) {
+		*xfer_id = WAC_CMD_ICON_BT_XFER;
+		return 256;
+	}
+
+	*xfer_id = WAC_CMD_ICON_XFER;
+	return 1024;
+}
+
 static ssize_t wacom_button_image_store(struct device *dev, int button_id,
 					const char *buf, size_t count)
 {
@@ -1161,13 +1562,7 @@ static ssize_t wacom_button_image_store(struct device *dev, int button_id,
 	unsigned len;
 	u8 xfer_id;
 
-	if (hdev->bus == BUS_BLUETOOTH) {
-		len = 256;
-		xfer_id = WAC_CMD_ICON_BT_XFER;
-	} else {
-		len = 1024;
-		xfer_id = WAC_CMD_ICON_XFER;
-	}
+	len = wacom_led_image_format(hdev, &xfer_id);
 
 	if (count != len)
 		return -EINVAL;
@@ -1176,6 +1571,16 @@ static ssize_t wacom_button_image_store(struct device *dev, int button_id,
 
 	err = wacom_led_putimage(wacom, button_id, xfer_id, len, buf);
 
+	/* keep wacom_led_rawimg and the reset_resume restore up to date */
+	if (wacom->led.frame) {
+		memcpy(wacom->led.frame + button_id * len, buf, len);
+		clear_bit(button_id, &wacom->led.img_pending);
+	}
+	if (err < 0)
+		wacom->led.img_hash[button_id] = 0;
+	else
+		wacom->led.img_hash[button_id] = jhash(buf, len, 0) ?: 1;
+
 	mutex_unlock(&wacom->lock);
 
 	return err < 0 ? err : count;
@@ -1199,9 +1604,164 @@ DEVICE_BTNIMG_ATTR(5);
 DEVICE_BTNIMG_ATTR(6);
 DEVICE_BTNIMG_ATTR(7);
 
+/*
+ * wacom_led_rawimg takes the images of all eight OLED buttons in one
+ * write, concatenated in button order. Only images that differ from
+ * what was last uploaded are sent, from a worker; readers can poll() the
+ * attribute to learn when the upload has finished.
+ */
+#define WACOM_OLED_COUNT	8
+
+static void wacom_oled_work(struct work_struct *work)
+{
+	struct wacom *wacom = container_of(work, struct wacom, oled_work);
+	unsigned int len;
+	u8 xfer_id;
+	int i;
+
+	len = wacom_led_image_format(wacom->hdev, &xfer_id);
+
+	for (i = 0; i < WACOM_OLED_COUNT; i++) {
+		mutex_lock(&wacom->lock);
+		if (wacom->led.frame &&
+		    test_and_clear_bit(i, &wacom->led.img_pending)) {
+			const u8 *img = wacom->led.frame + i * len;
+
+			if (wacom_led_putimage(wacom, i, xfer_id, len, img) < 0)
+				wacom->led.img_hash[i] = 0;
+			else
+				wacom->led.img_hash[i] = jhash(img, len, 0) ?: 1;
+		}
+		mutex_unlock(&wacom->lock);
+	}
+
+	sysfs_notify(&wacom->hdev->dev.kobj, "wacom_led", "wacom_led_rawimg");
+}
+
+static ssize_t wacom_led_rawimg_read(struct file *file, struct kobject *kobj,
+				     WACOM_BIN_ATTR *attr, char *buf,
+				     loff_t off, size_t count)
+{
+	struct hid_device *hdev = to_hid_device(kobj_to_dev(kobj));
+	struct wacom *wacom = hid_get_drvdata(hdev);
+	unsigned int len;
+	ssize_t ret;
+	u8 xfer_id;
+
+	len = wacom_led_image_format(hdev, &xfer_id);
+
+	mutex_lock(&wacom->lock);
+	ret = memory_read_from_buffer(buf, count, &off, wacom->led.frame,
+				      WACOM_OLED_COUNT * len);
+	mutex_unlock(&wacom->lock);
+
+	return ret;
+}
+
+static ssize_t wacom_led_rawimg_write(struct file *file, struct kobject *kobj,
+				      WACOM_BIN_ATTR *attr, char *buf,
+				      loff_t off, size_t count)
+{
+	struct hid_device *hdev = to_hid_device(kobj_to_dev(kobj));
+	struct wacom *wacom = hid_get_drvdata(hdev);
+	loff_t end = off + count;
+	unsigned int len;
+	u8 xfer_id;
+	int i;
+
+	len = wacom_led_image_format(hdev, &xfer_id);
+	if (end > WACOM_OLED_COUNT * len)
+		return -EFBIG;
+
+	mutex_lock(&wacom->lock);
+
+	memcpy(wacom->led.frame + off, buf, count);
+
+	/* queue every image whose last byte arrived with this write */
+	for (i = off / len; i < end / len; i++) {
+		u32 hash = jhash(wacom->led.frame + i * len, len, 0) ?: 1;
+
+		if (hash == wacom->led.img_hash[i])
+			continue;
+
+		wacom->led.img_hash[i] = hash;
+		set_bit(i, &wacom->led.img_pending);
+	}
+
+	if (wacom->led.img_pending && !wacom->removing)
+		queue_work(system_power_efficient_wq, &wacom->oled_work);
+
+	mutex_unlock(&wacom->lock);
+
+	return count;
+}
+
+/*
+ * The image size depends on the bus, so this is only a template: each
+ * tablet gets a copy with .size set to its frame size.
+ */
+static const struct bin_attribute bin_attr_wacom_led_rawimg = {
+	.attr = { .name = "wacom_led_rawimg", .mode = DEV_ATTR_RW_PERM },
+	.read = wacom_led_rawimg_read,
+	.write = wacom_led_rawimg_write,
+};
+
+static void wacom_oled_release(void *data)
+{
+	struct wacom *wacom = data;
+
+	cancel_work_sync(&wacom->oled_work);
+
+	wacom->led.frame = NULL;
+	wacom->led.img_pending = 0;
+}
+
+/*
+ * A USB reset blanks the OLED buttons; upload every image again. The
+ * hashes are cleared so that rewriting an image isn't skipped before
+ * the restore got to it.
+ */
+static void __maybe_unused wacom_oled_restore(struct wacom *wacom)
+{
+	mutex_lock(&wacom->lock);
+
+	if (wacom->led.frame && !wacom->removing) {
+		memset(wacom->led.img_hash, 0, sizeof(wacom->led.img_hash));
+		wacom->led.img_pending = BIT(WACOM_OLED_COUNT) - 1;
+		queue_work(system_power_efficient_wq, &wacom->oled_work);
+	}
+
+	mutex_unlock(&wacom->lock);
+}
+
+/* Must run before the wacom_led group exposes wacom_led_rawimg */
+static int wacom_initialize_oled(struct wacom *wacom)
+{
+	struct device *dev = &wacom->hdev->dev;
+	unsigned int len;
+	u8 xfer_id;
+
+	len = wacom_led_image_format(wacom->hdev, &xfer_id);
+
+	wacom->led.frame = devm_kzalloc(dev, WACOM_OLED_COUNT * len,
+					GFP_KERNEL);
+	if (!wacom->led.frame)
+		return -ENOMEM;
+
+	memset(wacom->led.img_hash, 0, sizeof(wacom->led.img_hash));
+
+	wacom->led.rawimg_attr = bin_attr_wacom_led_rawimg;
+	sysfs_bin_attr_init(&wacom->led.rawimg_attr);
+	wacom->led.rawimg_attr.size = WACOM_OLED_COUNT * len;
+	wacom->led.oled_bin_attrs[0] = &wacom->led.rawimg_attr;
+
+	return devm_add_action_or_reset(dev, wacom_oled_release, wacom);
+}
+
 static struct attribute *cintiq_led_attrs[] = {
 	&dev_attr_status_led0_select.attr,
 	&dev_attr_status_led1_select.attr,
+	&dev_attr_sync.attr,
 	NULL
 };
 
@@ -1223,6 +1783,7 @@ static struct attribute *intuos4_led_attrs[] = {
 	&dev_attr_button5_rawimg.attr,
 	&dev_attr_button6_rawimg.attr,
 	&dev_attr_button7_rawimg.attr,
+	&dev_attr_sync.attr,
 	NULL
 };
 
@@ -1234,6 +1795,7 @@ static const struct attribute_group intuos4_led_attr_group = {
 static struct attribute *intuos5_led_attrs[] = {
 	&dev_attr_status0_luminance.attr,
 	&dev_attr_status_led0_select.attr,
+	&dev_attr_sync.attr,
 	NULL
 };
 
@@ -1245,6 +1807,7 @@ static const struct attribute_group intuos5_led_attr_group = {
 static struct attribute *generic_led_attrs[] = {
 	&dev_attr_status0_luminance.attr,
 	&dev_attr_status_led0_select.attr,
+	&dev_attr_sync.attr,
 	NULL
 };
 
@@ -1365,27 +1928,24 @@ static int wacom_led_brightness_set(struct led_classdev *cdev,
 {
 	struct wacom_led *led = container_of(cdev, struct wacom_led, cdev);
 	struct wacom *wacom = led->wacom;
-	int error;
 
 	mutex_lock(&wacom->lock);
 
 	if (!wacom->led.groups || (brightness == LED_OFF &&
-	    wacom->led.groups[led->group].select != led->id)) {
-		error = 0;
+	    wacom->led.groups[led->group].select != led->id))
 		goto out;
-	}
 
 	led->llv = wacom->led.llv = wacom->led.max_llv * brightness / LED_FULL;
 	led->hlv = wacom->led.hlv = wacom->led.max_hlv * brightness / LED_FULL;
 
 	wacom->led.groups[led->group].select = led->id;
 
-	error = wacom_led_control(wacom);
+	wacom_led_schedule(wacom, WACOM_LED_FLUSH_DELAY_MS);
 
 out:
 	mutex_unlock(&wacom->lock);
 
-	return error;
+	return 0;
 }
 
 static void wacom_led_readonly_brightness_set(struct led_classdev *cdev,
@@ -1620,6 +2180,9 @@ int wacom_initialize_leds(struct wacom *wacom)
 	if (!(wacom->wacom_wac.features.device_type & WACOM_DEVICETYPE_PAD))
 		return 0;
 
+	wacom->led.applied = 0;
+	wacom->led.queued = 0;
+
 	/* Initialize default values */
 	switch (wacom->wacom_wac.features.type) {
 	case HID_GENERIC:
@@ -1656,8 +2219,15 @@ int wacom_initialize_leds(struct wacom *wacom)
 			return error;
 		}
 
+		error = wacom_initialize_oled(wacom);
+		if (error)
+			break;
+
+		/* add this tablet's wacom_led_rawimg, sized for its bus */
+		wacom->led.oled_group = intuos4_led_attr_group;
+		wacom->led.oled_group.bin_attrs = wacom->led.oled_bin_attrs;
 		error = wacom_devm_sysfs_create_group(wacom,
-						      &intuos4_led_attr_group);
+						      &wacom->led.oled_group);
 		break;
 
 	case WACOM_24HD:
@@ -1742,7 +2312,7 @@ static void wacom_init_work(struct work_struct *work)
 
 static void wacom_query_tablet_data(struct wacom *wacom)
 {
-	schedule_delayed_work(&wacom->init_work, msecs_to_jiffies(1000));
+	queue_delayed_work(wacom_wq, &wacom->init_work, msecs_to_jiffies(1000));
 }
 
 static enum power_supply_property wacom_battery_props[] = {
@@ -1794,6 +2364,14 @@ static int wacom_battery_get_property(struct power_supply *psy,
 	return ret;
 }
 
+static void wacom_battery_cancel_notify(void *data)
+{
+	struct wacom_battery *battery = data;
+
+	battery->battery = NULL;
+	cancel_delayed_work_sync(&battery->notify_work);
+}
+
 static int __wacom_initialize_battery(struct wacom *wacom,
 				      struct wacom_battery *battery)
 {
@@ -1828,6 +2406,14 @@ static int __wacom_initialize_battery(struct wacom *wacom,
 
 	power_supply_powers(ps_bat, &wacom->hdev->dev);
 
+	INIT_DELAYED_WORK(&battery->notify_work, wacom_battery_notify_work);
+	error = devm_add_action_or_reset(dev, wacom_battery_cancel_notify,
+					 battery);
+	if (error)
+		goto err;
+
+	battery->notified_capacity = battery->battery_capacity;
+	battery->notified_at = jiffies;
 	battery->battery = ps_bat;
 
 	devres_close_group(dev, bat_desc);
@@ -2134,6 +2720,9 @@ static int wacom_allocate_inputs(struct wacom *wacom)
 	wacom_wac->touch_input->name = wacom_wac->touch_name;
 	wacom_wac->pad_input->name = wacom_wac->pad_name;
 
+	/* fresh input devices start with all buttons released */
+	wacom_wac->pad_buttons = 0;
+
 	return 0;
 }
 
@@ -2251,6 +2840,8 @@ void wacom_battery_work(struct work_struct *work)
 {
 	struct wacom *wacom = container_of(work, struct wacom, battery_work);
 
+	wacom_work_started(wacom, WACOM_WORKER_BATTERY);
+
 	if ((wacom->wacom_wac.features.quirks & WACOM_QUIRK_BATTERY) &&
 	     !wacom->battery.battery) {
 		wacom_initialize_battery(wacom);
@@ -2519,6 +3110,118 @@ fail:
 	return error;
 }
 
+static struct wacom *wacom_wireless_get_interface(struct usb_device *usbdev,
+						  int n)
+{
+	struct hid_device *hdev = usb_get_intfdata(usbdev->config->interface[n]);
+	struct wacom *wacom = hdev ? hid_get_drvdata(hdev) : NULL;
+
+	/* pairs with the release in wacom_probe(): its inputs are set up */
+	return wacom && smp_load_acquire(&wacom->wacom_wac.probe_complete) ?
+	       wacom : NULL;
+}
+
+/*
+ * With asynchronous probing the pen and touch interfaces of a receiver
+ * may not be bound yet when it reports a connection; their probe kicks
+ * the receiver again once they are.
+ */
+static bool wacom_wireless_get_siblings(struct wacom *wacom,
+					struct wacom **pen, struct wacom **touch)
+{
+	struct usb_device *usbdev = wacom->usbdev;
+
+	*pen = wacom_wireless_get_interface(usbdev, 1);
+	*touch = wacom_wireless_get_interface(usbdev, 2);
+
+	return *pen && *touch;
+}
+
+/* The receiver on interface 0 if @wacom is one of its pen/touch siblings */
+static struct wacom *wacom_wireless_receiver(struct wacom *wacom)
+{
+	struct hid_device *hdev;
+	struct wacom *receiver;
+
+	if (!wacom->usbdev ||
+	    wacom->intf == wacom->usbdev->config->interface[0])
+		return NULL;
+
+	hdev = usb_get_intfdata(wacom->usbdev->config->interface[0]);
+	receiver = hdev ? hid_get_drvdata(hdev) : NULL;
+
+	return receiver && receiver->wacom_wac.features.type == WIRELESS ?
+	       receiver : NULL;
+}
+
+static void wacom_wireless_sibling_ready(struct wacom *wacom)
+{
+	struct wacom *receiver;
+
+	if (wacom->wacom_wac.features.type != WIRELESS)
+		return;
+
+	receiver = wacom_wireless_receiver(wacom);
+	if (receiver && receiver->wacom_wac.pid)
+		wacom_schedule_work(&receiver->wacom_wac,
+				    WACOM_WORKER_WIRELESS);
+}
+
+/*
+ * The receiver's wireless and release work act on its siblings without
+ * holding them; a sibling going away hides itself from
+ * wacom_wireless_get_siblings() and then waits for both to finish.
+ */
+static void wacom_wireless_sibling_remove(struct wacom *wacom)
+{
+	struct wacom *receiver = wacom_wireless_receiver(wacom);
+
+	if (!receiver)
+		return;
+
+	WRITE_ONCE(wacom->wacom_wac.probe_complete, false);
+	flush_work(&receiver->wireless_work);
+	cancel_delayed_work_sync(&receiver->wireless_release_work);
+}
+
+static void wacom_wireless_release_work(struct work_struct *work)
+{
+	struct wacom *wacom = container_of(work, struct wacom,
+					   wireless_release_work.work);
+	struct wacom *wacom1, *wacom2;
+
+	if (!wacom->usbdev ||
+	    !wacom_wireless_get_siblings(wacom, &wacom1, &wacom2))
+		return;
+
+	wacom_release_resources(wacom1);
+	wacom_release_resources(wacom2);
+}
+
+/*
+ * Release anything held down on the interfaces of a tablet that just
+ * dropped its link, keeping the input devices for a quick reconnect.
+ */
+static void wacom_wireless_linger(struct wacom *wacom1, struct wacom *wacom2)
+{
+	struct wacom *siblings[] = { wacom1, wacom2 };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(siblings); i++) {
+		struct wacom_wac *wacom_wac = &siblings[i]->wacom_wac;
+
+		if (!siblings[i]->resources)
+			continue;
+
+		if (wacom_wac->pen_input)
+			input_reset_device(wacom_wac->pen_input);
+		if (wacom_wac->touch_input)
+			input_reset_device(wacom_wac->touch_input);
+		if (wacom_wac->pad_input)
+			input_reset_device(wacom_wac->pad_input);
+	}
+}
+
 static void wacom_wireless_work(struct work_struct *work)
 {
 	struct wacom *wacom = container_of(work, struct wacom, wireless_work);
@@ -2527,11 +3230,14 @@ static void wacom_wireless_work(struct work_struct *work)
 	struct hid_device *hdev1, *hdev2;
 	struct wacom *wacom1, *wacom2;
 	struct wacom_wac *wacom_wac1, *wacom_wac2;
+	unsigned int linger = READ_ONCE(wireless_linger);
 	int error;
 
+	wacom_work_started(wacom, WACOM_WORKER_WIRELESS);
+
 	/*
 	 * Regardless if this is a disconnect or a new tablet,
-	 * remove any existing input and battery devices.
+	 * remove any existing battery devices.
 	 */
 
 	wacom_destroy_battery(wacom);
@@ -2539,26 +3245,42 @@ static void wacom_wireless_work(struct work_struct *work)
 	if (!usbdev)
 		return;
 
-	/* Stylus interface */
-	hdev1 = usb_get_intfdata(usbdev->config->interface[1]);
-	wacom1 = hid_get_drvdata(hdev1);
-	wacom_wac1 = &(wacom1->wacom_wac);
-	wacom_release_resources(wacom1);
+	cancel_delayed_work_sync(&wacom->wireless_release_work);
+
+	if (!wacom_wireless_get_siblings(wacom, &wacom1, &wacom2))
+		return;
 
-	/* Touch interface */
-	hdev2 = usb_get_intfdata(usbdev->config->interface[2]);
-	wacom2 = hid_get_drvdata(hdev2);
+	hdev1 = wacom1->hdev;
+	wacom_wac1 = &(wacom1->wacom_wac);
+	hdev2 = wacom2->hdev;
 	wacom_wac2 = &(wacom2->wacom_wac);
-	wacom_release_resources(wacom2);
 
 	if (wacom_wac->pid == 0) {
 		hid_info(wacom->hdev, "wireless tablet disconnected\n");
+
+		if (linger && wacom1->resources) {
+			wacom_wireless_linger(wacom1, wacom2);
+			queue_delayed_work(wacom_wq,
+					   &wacom->wireless_release_work,
+					   msecs_to_jiffies(linger));
+			return;
+		}
+
+		wacom_release_resources(wacom1);
+		wacom_release_resources(wacom2);
 	} else {
 		const struct hid_device_id *id = wacom_ids;
 
 		hid_info(wacom->hdev, "wireless tablet connected with PID %x\n",
 			 wacom_wac->pid);
 
+		/* same tablet came back before its input devices went away */
+		if (wacom1->resources && wacom_wac1->pid == wacom_wac->pid)
+			return;
+
+		wacom_release_resources(wacom1);
+		wacom_release_resources(wacom2);
+
 		while (id->bus) {
 			if (id->vendor == USB_VENDOR_ID_WACOM &&
 			    id->product == wacom_wac->pid)
@@ -2611,12 +3333,16 @@ fail:
 static void wacom_remote_destroy_battery(struct wacom *wacom, int index)
 {
 	struct wacom_remote *remote = wacom->remote;
+	unsigned long flags;
 
 	if (remote->remotes[index].battery.battery) {
+		/* wait for wacom_remote_irq() to finish notifying it */
+		spin_lock_irqsave(&remote->remote_lock, flags);
+		remote->remotes[index].battery.battery = NULL;
+		spin_unlock_irqrestore(&remote->remote_lock, flags);
 		devres_release_group(&wacom->hdev->dev,
 				     &remote->remotes[index].battery.bat_desc);
-		remote->remotes[index].battery.battery = NULL;
-		remote->remotes[index].active_time = 0;
+		WRITE_ONCE(remote->remotes[index].active_time, 0);
 	}
 }
 
@@ -2625,14 +3351,14 @@ static void wacom_remote_destroy_one(struct wacom *wacom, unsigned int index)
 	struct wacom_remote *remote = wacom->remote;
 	u32 serial = remote->remotes[index].serial;
 	int i;
-	unsigned long flags;
 
 	for (i = 0; i < WACOM_MAX_REMOTES; i++) {
 		if (remote->remotes[i].serial == serial) {
 
-			spin_lock_irqsave(&remote->remote_lock, flags);
-			remote->remotes[i].registered = false;
-			spin_unlock_irqrestore(&remote->remote_lock, flags);
+			WRITE_ONCE(remote->remotes[i].registered, false);
+			RCU_INIT_POINTER(remote->remotes[i].active, NULL);
+			/* wait for wacom_remote_irq() to drop the input */
+			synchronize_rcu();
 
 			wacom_remote_destroy_battery(wacom, i);
 
@@ -2640,7 +3366,7 @@ static void wacom_remote_destroy_one(struct wacom *wacom, unsigned int index)
 				devres_release_group(&wacom->hdev->dev,
 						     &remote->remotes[i]);
 
-			remote->remotes[i].serial = 0;
+			WRITE_ONCE(remote->remotes[i].serial, 0);
 			remote->remotes[i].group.name = NULL;
 			wacom->led.groups[i].select = WACOM_STATUS_UNKNOWN;
 		}
@@ -2663,7 +3389,7 @@ static int wacom_remote_create_one(struct wacom *wacom, u32 serial,
 	}
 
 	if (k < WACOM_MAX_REMOTES) {
-		remote->remotes[index].serial = serial;
+		WRITE_ONCE(remote->remotes[index].serial, serial);
 		return 0;
 	}
 
@@ -2681,6 +3407,7 @@ static int wacom_remote_create_one(struct wacom *wacom, u32 serial,
 	}
 	remote->remotes[index].input->uniq = remote->remotes[index].group.name;
 	remote->remotes[index].input->name = wacom->wacom_wac.pad_name;
+	remote->remotes[index].buttons = 0;
 
 	if (!remote->remotes[index].input->name) {
 		error = -EINVAL;
@@ -2692,7 +3419,7 @@ static int wacom_remote_create_one(struct wacom *wacom, u32 serial,
 	if (error)
 		goto fail;
 
-	remote->remotes[index].serial = serial;
+	WRITE_ONCE(remote->remotes[index].serial, serial);
 
 	error = input_register_device(remote->remotes[index].input);
 	if (error)
@@ -2704,14 +3431,16 @@ static int wacom_remote_create_one(struct wacom *wacom, u32 serial,
 	if (error)
 		goto fail;
 
-	remote->remotes[index].registered = true;
+	WRITE_ONCE(remote->remotes[index].registered, true);
+	rcu_assign_pointer(remote->remotes[index].active,
+			   remote->remotes[index].input);
 
 	devres_close_group(dev, &remote->remotes[index]);
 	return 0;
 
 fail:
 	devres_release_group(dev, &remote->remotes[index]);
-	remote->remotes[index].serial = 0;
+	WRITE_ONCE(remote->remotes[index].serial, 0);
 	return error;
 }
 
@@ -2740,56 +3469,159 @@ static int wacom_remote_attach_battery(struct wacom *wacom, int index)
 	return 0;
 }
 
+/*
+ * Unpair the remote in slot @index. A remote that paired more than once
+ * only owns its input device in the first slot; dropping one of the
+ * other slots must not take the device down with it.
+ */
+static void wacom_remote_release_one(struct wacom *wacom, unsigned int index)
+{
+	struct wacom_remote *remote = wacom->remote;
+
+	if (!remote->remotes[index].group.name) {
+		WRITE_ONCE(remote->remotes[index].serial, 0);
+		wacom->led.groups[index].select = WACOM_STATUS_UNKNOWN;
+		return;
+	}
+
+	wacom_remote_destroy_one(wacom, index);
+}
+
+static void wacom_remote_update_batteries(struct wacom *wacom)
+{
+	struct wacom_remote *remote = wacom->remote;
+	ktime_t kt = ktime_get();
+	int i;
+
+	for (i = 0; i < WACOM_MAX_REMOTES; i++) {
+		if (!remote->remotes[i].serial)
+			continue;
+
+		if (kt - remote->remotes[i].active_time > WACOM_REMOTE_BATTERY_TIMEOUT
+		    && remote->remotes[i].active_time != 0)
+			wacom_remote_destroy_battery(wacom, i);
+		else
+			wacom_remote_attach_battery(wacom, i);
+	}
+}
+
 static void wacom_remote_work(struct work_struct *work)
 {
 	struct wacom *wacom = container_of(work, struct wacom, remote_work);
 	struct wacom_remote *remote = wacom->remote;
-	ktime_t kt = ktime_get();
 	struct wacom_remote_work_data remote_work_data;
 	unsigned long flags;
 	unsigned int count;
 	u32 work_serial;
 	int i;
 
+	wacom_work_started(wacom, WACOM_WORKER_REMOTE);
+
 	spin_lock_irqsave(&remote->remote_lock, flags);
 
 	count = kfifo_out(&remote->remote_fifo, &remote_work_data,
 			  sizeof(remote_work_data));
 
-	if (count != sizeof(remote_work_data)) {
-		hid_err(wacom->hdev,
-			"workitem triggered without status available\n");
-		spin_unlock_irqrestore(&remote->remote_lock, flags);
-		return;
-	}
-
 	if (!kfifo_is_empty(&remote->remote_fifo))
 		wacom_schedule_work(&wacom->wacom_wac, WACOM_WORKER_REMOTE);
 
 	spin_unlock_irqrestore(&remote->remote_lock, flags);
 
+	/* an unchanged device list only schedules battery housekeeping */
+	if (count != sizeof(remote_work_data))
+		goto batteries;
+
+	/* first drop the slots whose pairing went away or changed... */
+	for (i = 0; i < WACOM_MAX_REMOTES; i++) {
+		if (remote->remotes[i].serial &&
+		    remote->remotes[i].serial != remote_work_data.remote[i].serial)
+			wacom_remote_release_one(wacom, i);
+	}
+
+	/* ...then pair the new ones, leaving unchanged slots alone */
 	for (i = 0; i < WACOM_MAX_REMOTES; i++) {
 		work_serial = remote_work_data.remote[i].serial;
-		if (work_serial) {
+		if (!work_serial || remote->remotes[i].serial == work_serial)
+			continue;
 
-			if (kt - remote->remotes[i].active_time > WACOM_REMOTE_BATTERY_TIMEOUT
-			    && remote->remotes[i].active_time != 0)
-				wacom_remote_destroy_battery(wacom, i);
+		if (wacom_remote_create_one(wacom, work_serial, i)) {
+			/* let the next device list retry this slot */
+			spin_lock_irqsave(&remote->remote_lock, flags);
+			remote->last_status.remote[i].serial = 0;
+			spin_unlock_irqrestore(&remote->remote_lock, flags);
+		}
+	}
 
-			if (remote->remotes[i].serial == work_serial) {
-				wacom_remote_attach_battery(wacom, i);
-				continue;
-			}
+batteries:
+	wacom_remote_update_batteries(wacom);
+}
 
-			if (remote->remotes[i].serial)
-				wacom_remote_destroy_one(wacom, i);
+/*
+ * Flip INPUT_PROP_DIRECT/INPUT_PROP_POINTER on the registered pen and
+ * touch inputs. Multitouch pointer emulation additionally advertises the
+ * BTN_TOOL_* finger count codes, so when the switch changes the event
+ * codes of an input device, return -EAGAIN and let the caller re-parse
+ * the interface instead.
+ */
+static int wacom_mode_change_in_place(struct wacom *wacom, bool is_direct)
+{
+	struct wacom_wac *wacom_wac = &wacom->wacom_wac;
+	struct wacom_features *features = &wacom_wac->features;
+	struct input_dev *inputs[] = {
+		wacom_wac->pen_input,
+		wacom_wac->touch_input,
+	};
+	int i;
 
-			wacom_remote_create_one(wacom, work_serial, i);
+	if (!wacom->resources || features->type != HID_GENERIC)
+		return -EAGAIN;
 
-		} else if (remote->remotes[i].serial) {
-			wacom_remote_destroy_one(wacom, i);
+	if (wacom_wac->touch_input && features->touch_max > 1)
+		return -EAGAIN;
+
+	if (is_direct)
+		features->device_type |= WACOM_DEVICETYPE_DIRECT;
+	else
+		features->device_type &= ~WACOM_DEVICETYPE_DIRECT;
+
+	for (i = 0; i < ARRAY_SIZE(inputs); i++) {
+		if (!inputs[i])
+			continue;
+
+		if (is_direct) {
+			__clear_bit(INPUT_PROP_POINTER, inputs[i]->propbit);
+			__set_bit(INPUT_PROP_DIRECT, inputs[i]->propbit);
+		} else {
+			__clear_bit(INPUT_PROP_DIRECT, inputs[i]->propbit);
+			__set_bit(INPUT_PROP_POINTER, inputs[i]->propbit);
 		}
+
+		/* let udev re-classify the device */
+		kobject_uevent(&inputs[i]->dev.kobj, KOBJ_CHANGE);
 	}
+
+	return 0;
+}
+
+static int wacom_mode_change_one(struct wacom *wacom, bool is_direct)
+{
+	struct wacom_wac *wacom_wac = &wacom->wacom_wac;
+	bool was_direct = wacom_wac->features.device_type &
+			  WACOM_DEVICETYPE_DIRECT;
+
+	wacom_wac->has_mode_change = true;
+	wacom_wac->is_direct_mode = is_direct;
+
+	/* the mode may have bounced back before the work got to run */
+	if (wacom->resources && was_direct == is_direct)
+		return 0;
+
+	if (!wacom_mode_change_in_place(wacom, is_direct))
+		return 0;
+
+	wacom_release_resources(wacom);
+	hid_hw_stop(wacom->hdev);
+	return wacom_parse_and_register(wacom, false);
 }
 
 static void wacom_mode_change_work(struct work_struct *work)
@@ -2799,37 +3631,65 @@ static void wacom_mode_change_work(struct work_struct *work)
 	struct wacom *wacom1 = NULL;
 	struct wacom *wacom2 = NULL;
 	bool is_direct = wacom->wacom_wac.is_direct_mode;
+	ktime_t start = ktime_get();
 	int error = 0;
 
-	if (shared->pen) {
+	wacom_work_started(wacom, WACOM_WORKER_MODE_CHANGE);
+
+	if (shared->pen)
 		wacom1 = hid_get_drvdata(shared->pen);
-		wacom_release_resources(wacom1);
-		hid_hw_stop(wacom1->hdev);
-		wacom1->wacom_wac.has_mode_change = true;
-		wacom1->wacom_wac.is_direct_mode = is_direct;
-	}
 
-	if (shared->touch) {
+	if (shared->touch)
 		wacom2 = hid_get_drvdata(shared->touch);
-		wacom_release_resources(wacom2);
-		hid_hw_stop(wacom2->hdev);
-		wacom2->wacom_wac.has_mode_change = true;
-		wacom2->wacom_wac.is_direct_mode = is_direct;
-	}
 
 	if (wacom1) {
-		error = wacom_parse_and_register(wacom1, false);
+		error = wacom_mode_change_one(wacom1, is_direct);
 		if (error)
 			return;
 	}
 
 	if (wacom2) {
-		error = wacom_parse_and_register(wacom2, false);
+		error = wacom_mode_change_one(wacom2, is_direct);
 		if (error)
 			return;
 	}
 
-	return;
+	hid_dbg(wacom->hdev, "switched to %s mode in %lld us\n",
+		is_direct ? "direct" : "indirect",
+		ktime_us_delta(ktime_get(), start));
+}
+
+static void wacom_debugfs_remove(void *data)
+{
+	struct wacom *wacom = data;
+
+	debugfs_remove_recursive(wacom->debugfs);
+}
+
+/* Counters for tuning and bug reports; not a stable interface */
+static int wacom_debugfs_init(struct wacom *wacom)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir(dev_name(&wacom->hdev->dev),
+				 wacom_debugfs_root);
+	wacom->debugfs = dir;
+
+	debugfs_create_u32("feature_cache_hits", 0444, dir,
+			   &wacom->stats.feature_cache_hits);
+	debugfs_create_u32("feature_cache_misses", 0444, dir,
+			   &wacom->stats.feature_cache_misses);
+	/* longest time driver work waited to run, write 0 to reset */
+	debugfs_create_u32("work_delay_max_us", 0600, dir,
+			   &wacom->stats.work_delay_max_us);
+	/* time the last resume blocked, LED restore excluded */
+	debugfs_create_u32("resume_us", 0444, dir, &wacom->stats.resume_us);
+	/* battery capacity uevents deferred or merged */
+	debugfs_create_u32("battery_notify_suppressed", 0444, dir,
+			   &wacom->stats.battery_notify_suppressed);
+
+	return devm_add_action_or_reset(&wacom->hdev->dev,
+					wacom_debugfs_remove, wacom);
 }
 
 static int wacom_probe(struct hid_device *hdev,
@@ -2840,6 +3700,8 @@ static int wacom_probe(struct hid_device *hdev,
 	struct wacom_features *features;
 	int error;
 
+	wacom_check_layout();
+
 	if (!id->driver_data)
 		return -EINVAL;
 
@@ -2877,11 +3739,21 @@ static int wacom_probe(struct hid_device *hdev,
 	INIT_DELAYED_WORK(&wacom->init_work, wacom_init_work);
 	INIT_DELAYED_WORK(&wacom->aes_battery_work, wacom_aes_battery_handler);
 	INIT_WORK(&wacom->wireless_work, wacom_wireless_work);
+	INIT_DELAYED_WORK(&wacom->wireless_release_work, wacom_wireless_release_work);
 	INIT_WORK(&wacom->battery_work, wacom_battery_work);
 	INIT_WORK(&wacom->remote_work, wacom_remote_work);
 	INIT_WORK(&wacom->mode_change_work, wacom_mode_change_work);
+	INIT_DELAYED_WORK(&wacom->led_work, wacom_led_work);
+	INIT_WORK(&wacom->oled_work, wacom_oled_work);
+	INIT_LIST_HEAD(&wacom->cmd_queue);
+	spin_lock_init(&wacom->cmd_lock);
+	INIT_WORK(&wacom->cmd_work, wacom_cmd_work);
 	timer_setup(&wacom->idleprox_timer, &wacom_idleprox_timeout, TIMER_DEFERRABLE);
 
+	error = wacom_debugfs_init(wacom);
+	if (error)
+		return error;
+
 	/* ask for the report descriptor to be loaded by HID */
 	error = hid_parse(hdev);
 	if (error) {
@@ -2906,7 +3778,9 @@ static int wacom_probe(struct hid_device *hdev,
 				 error);
 	}
 
-	wacom_wac->probe_complete = true;
+	/* publish the interface to its siblings only once it is set up */
+	smp_store_release(&wacom_wac->probe_complete, true);
+	wacom_wireless_sibling_ready(wacom);
 	return 0;
 }
 
@@ -2919,14 +3793,28 @@ static void wacom_remove(struct hid_device *hdev)
 	if (features->device_type & WACOM_DEVICETYPE_WL_MONITOR)
 		hid_hw_close(hdev);
 
+	wacom_wireless_sibling_remove(wacom);
+
 	hid_hw_stop(hdev);
 
+	/*
+	 * The LED attributes and classdevs stay around until the resources
+	 * are released below; make them stop queueing work first.
+	 */
+	mutex_lock(&wacom->lock);
+	wacom->removing = true;
+	mutex_unlock(&wacom->lock);
+
 	cancel_delayed_work_sync(&wacom->init_work);
 	cancel_delayed_work_sync(&wacom->aes_battery_work);
 	cancel_work_sync(&wacom->wireless_work);
+	cancel_delayed_work_sync(&wacom->wireless_release_work);
 	cancel_work_sync(&wacom->battery_work);
 	cancel_work_sync(&wacom->remote_work);
 	cancel_work_sync(&wacom->mode_change_work);
+	cancel_delayed_work_sync(&wacom->led_work);
+	cancel_work_sync(&wacom->oled_work);
+	wacom_cancel_reports(wacom);
 #ifdef WACOM_TIMER_DELETE_SYNC
 	timer_delete_sync(&wacom->idleprox_timer);
 #else
@@ -2948,21 +3836,37 @@ static void wacom_remove(struct hid_device *hdev)
 static int wacom_resume(struct hid_device *hdev)
 {
 	struct wacom *wacom = hid_get_drvdata(hdev);
+	ktime_t start = ktime_get();
 
 	mutex_lock(&wacom->lock);
 
-	/* switch to wacom mode first */
+	/* switch to wacom mode first, the LEDs can wait */
 	_wacom_query_tablet_data(wacom);
-	wacom_led_control(wacom);
 
 	mutex_unlock(&wacom->lock);
 
+	if (wacom->led.groups)
+		wacom_led_schedule(wacom, 0);
+
+	WRITE_ONCE(wacom->stats.resume_us,
+		   min_t(s64, ktime_us_delta(ktime_get(), start), U32_MAX));
+
 	return 0;
 }
 
 static int wacom_reset_resume(struct hid_device *hdev)
 {
-	return wacom_resume(hdev);
+	struct wacom *wacom = hid_get_drvdata(hdev);
+	int error;
+
+	/* the device lost whatever we had sent it */
+	wacom->led.applied = 0;
+	wacom->led.queued = 0;
+
+	error = wacom_resume(hdev);
+	wacom_oled_restore(wacom);
+
+	return error;
 }
 #ifndef HAVE_PM_PTR
 #endif /* CONFIG_PM */
@@ -2984,8 +3888,42 @@ static struct hid_driver wacom_driver = {
 #endif
 #endif
 	.raw_event =	wacom_raw_event,
+	.driver = {
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
 };
-module_hid_driver(wacom_driver);
+
+static int __init wacom_init(void)
+{
+	int error;
+
+	/* tunable through /sys/devices/virtual/workqueue/wacom */
+	wacom_wq = alloc_workqueue("wacom",
+				   WQ_HIGHPRI | WQ_UNBOUND | WQ_SYSFS, 0);
+	if (!wacom_wq)
+		return -ENOMEM;
+
+	wacom_debugfs_root = debugfs_create_dir("wacom", NULL);
+
+	error = hid_register_driver(&wacom_driver);
+	if (error) {
+		debugfs_remove_recursive(wacom_debugfs_root);
+		destroy_workqueue(wacom_wq);
+	}
+
+	return error;
+}
+
+static void __exit wacom_exit(void)
+{
+	hid_unregister_driver(&wacom_driver);
+	debugfs_remove_recursive(wacom_debugfs_root);
+	destroy_workqueue(wacom_wq);
+	wacom_feature_cache_flush();
+}
+
+module_init(wacom_init);
+module_exit(wacom_exit);
 
 MODULE_VERSION(DRIVER_VERSION);
 MODULE_AUTHOR(DRIVER_AUTHOR);
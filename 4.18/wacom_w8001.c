@@ -12,12 +12,18 @@
  * Layout based on Elo serial touchscreen driver by Vojtech Pavlik
  */
 
+#include "../config.h"
+
 #include <linux/errno.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/input/mt.h>
 #include <linux/serio.h>
+#include <linux/serdev.h>
+#include <linux/of.h>
+#include <linux/property.h>
+#include <linux/debugfs.h>
 #include <linux/ctype.h>
 #include <linux/delay.h>
 
@@ -56,6 +62,8 @@ MODULE_LICENSE("GPL");
 #define W8001_PEN_RESOLUTION    100
 #define W8001_TOUCH_RESOLUTION  10
 
+#define W8001_DEFAULT_SPEED	19200
+
 struct w8001_coord {
 	u8 rdy;
 	u8 tsw;
@@ -85,9 +93,14 @@ struct w8001 {
 	struct input_dev *pen_dev;
 	struct input_dev *touch_dev;
 	struct serio *serio;
+	struct serdev_device *serdev;
+	struct device *dev;
 	struct completion cmd_done;
 	int id;
 	int idx;
+	unsigned int len;	/* length of the packet being assembled */
+	u32 resyncs;		/* times w8001_receive() dropped data */
+	struct dentry *debugfs;
 	unsigned char response_type;
 	unsigned char response[W8001_MAX_LENGTH];
 	unsigned char data[W8001_MAX_LENGTH];
@@ -104,7 +117,7 @@ struct w8001 {
 	struct mutex mutex;
 };
 
-static void parse_pen_data(u8 *data, struct w8001_coord *coord)
+static void parse_pen_data(const u8 *data, struct w8001_coord *coord)
 {
 	memset(coord, 0, sizeof(*coord));
 
@@ -128,7 +141,7 @@ static void parse_pen_data(u8 *data, struct w8001_coord *coord)
 	coord->tilt_y = data[8] & 0x7F;
 }
 
-static void parse_single_touch(u8 *data, struct w8001_coord *coord)
+static void parse_single_touch(const u8 *data, struct w8001_coord *coord)
 {
 	coord->x = (data[1] << 7) | data[2];
 	coord->y = (data[3] << 7) | data[4];
@@ -145,10 +158,9 @@ static void scale_touch_coordinates(struct w8001 *w8001,
 		*y = *y * w8001->max_pen_y / w8001->max_touch_y;
 }
 
-static void parse_multi_touch(struct w8001 *w8001)
+static void parse_multi_touch(struct w8001 *w8001, const u8 *data)
 {
 	struct input_dev *dev = w8001->touch_dev;
-	unsigned char *data = w8001->data;
 	unsigned int x, y;
 	int i;
 	int count = 0;
@@ -340,7 +352,7 @@ static irqreturn_t w8001_interrupt(struct serio *serio,
 	/* 2 finger touch packet */
 	case W8001_PKTLEN_TOUCH2FG - 1:
 		w8001->idx = 0;
-		parse_multi_touch(w8001);
+		parse_multi_touch(w8001, w8001->data);
 		break;
 
 	default:
@@ -356,6 +368,147 @@ static irqreturn_t w8001_interrupt(struct serio *serio,
 	return IRQ_HANDLED;
 }
 
+/*
+ * Length of the packet started by lead byte @lead, or 0 if we can't
+ * make sense of it: touch packets have the size the touch query told
+ * us about, query replies carry the tablet bit, pen packets don't.
+ */
+static unsigned int w8001_packet_len(struct w8001 *w8001, u8 lead)
+{
+	if ((lead & W8001_TOUCH_MASK) == W8001_TOUCH_BYTE)
+		return w8001->touch_dev ? w8001->pktlen : 0;
+
+	if ((lead & W8001_TAB_MASK) == W8001_TAB_BYTE)
+		return W8001_PKTLEN_TPCCTL;
+
+	return W8001_PKTLEN_TPCPEN;
+}
+
+static void w8001_handle_packet(struct w8001 *w8001, const u8 *data,
+				unsigned int len)
+{
+	struct w8001_coord coord;
+
+	switch (len) {
+	case W8001_PKTLEN_TOUCH93:
+	case W8001_PKTLEN_TOUCH9A:
+		if (w8001->type != BTN_TOOL_PEN &&
+		    w8001->type != BTN_TOOL_RUBBER) {
+			parse_single_touch(data, &coord);
+			report_single_touch(w8001, &coord);
+		}
+		break;
+
+	case W8001_PKTLEN_TPCPEN:
+		if (!w8001->pen_dev)
+			break;
+		parse_pen_data(data, &coord);
+		report_pen_events(w8001, &coord);
+		break;
+
+	case W8001_PKTLEN_TPCCTL:
+		memcpy(w8001->response, data, len);
+		w8001->response_type = W8001_QUERY_PACKET;
+		complete(&w8001->cmd_done);
+		break;
+
+	case W8001_PKTLEN_TOUCH2FG:
+		parse_multi_touch(w8001, data);
+		break;
+	}
+}
+
+static const u8 *w8001_find_lead(const u8 *p, const u8 *end)
+{
+	while (p < end && !(*p & W8001_LEAD_MASK))
+		p++;
+
+	return p;
+}
+
+/*
+ * Parse a whole buffer of serial data at once. Only the lead byte of a
+ * packet has W8001_LEAD_MASK set, so complete packets are reported
+ * straight from @buf and a lead byte in the middle of a packet means we
+ * lost sync. A packet split across buffers is assembled in w8001->data.
+ */
+static void w8001_receive(struct w8001 *w8001, const u8 *buf, size_t count)
+{
+	const u8 *end = buf + count;
+	const u8 *lead;
+	unsigned int n;
+
+	while (buf < end) {
+		if (w8001->idx) {
+			n = min_t(size_t, w8001->len - w8001->idx, end - buf);
+			lead = w8001_find_lead(buf, buf + n);
+			if (lead != buf + n) {
+				w8001->resyncs++;
+				w8001->idx = 0;
+				buf = lead;
+				continue;
+			}
+
+			memcpy(&w8001->data[w8001->idx], buf, n);
+			w8001->idx += n;
+			buf += n;
+
+			if (w8001->idx == w8001->len) {
+				w8001->idx = 0;
+				w8001_handle_packet(w8001, w8001->data,
+						    w8001->len);
+			}
+			continue;
+		}
+
+		lead = w8001_find_lead(buf, end);
+		if (lead != buf) {
+			pr_debug("w8001: unsynchronized data: 0x%02x\n", *buf);
+			w8001->resyncs++;
+			buf = lead;
+			continue;
+		}
+
+		w8001->len = w8001_packet_len(w8001, *buf);
+		if (!w8001->len) {
+			w8001->resyncs++;
+			buf++;
+			continue;
+		}
+
+		if (end - buf < w8001->len) {
+			/* keep the tail for the next buffer */
+			w8001->data[0] = *buf++;
+			w8001->idx = 1;
+			continue;
+		}
+
+		lead = w8001_find_lead(buf + 1, buf + w8001->len);
+		if (lead != buf + w8001->len) {
+			w8001->resyncs++;
+			buf = lead;
+			continue;
+		}
+
+		w8001_handle_packet(w8001, buf, w8001->len);
+		buf += w8001->len;
+	}
+}
+
+static int w8001_write(struct w8001 *w8001, unsigned char command)
+{
+	int rc;
+
+	if (!w8001->serdev)
+		return serio_write(w8001->serio, command);
+
+	rc = serdev_device_write_buf(w8001->serdev, &command, 1);
+	if (rc < 0)
+		return rc;
+
+	return rc == 1 ? 0 : -EIO;
+}
+
 static int w8001_command(struct w8001 *w8001, unsigned char command,
 			 bool wait_response)
 {
@@ -364,7 +517,7 @@ static int w8001_command(struct w8001 *w8001, unsigned char command,
 	w8001->response_type = 0;
 	init_completion(&w8001->cmd_done);
 
-	rc = serio_write(w8001->serio, command);
+	rc = w8001_write(w8001, command);
 	if (rc == 0 && wait_response) {
 
 		wait_for_completion_timeout(&w8001->cmd_done, HZ);
@@ -522,7 +675,7 @@ static int w8001_setup_touch(struct w8001 *w8001, char *basename,
 		__set_bit(BTN_TOOL_DOUBLETAP, dev->keybit);
 		error = input_mt_init_slots(dev, 2, 0);
 		if (error) {
-			dev_err(&w8001->serio->dev,
+			dev_err(w8001->dev,
 				"failed to initialize MT slots: %d\n", error);
 			return error;
 		}
@@ -549,8 +702,7 @@ static int w8001_setup_touch(struct w8001 *w8001, char *basename,
 	return 0;
 }
 
-static void w8001_set_devdata(struct input_dev *dev, struct w8001 *w8001,
-			      struct serio *serio)
+static void w8001_set_devdata(struct input_dev *dev, struct w8001 *w8001)
 {
 	dev->phys = w8001->phys;
 	dev->id.bustype = BUS_RS232;
@@ -560,11 +712,57 @@ static void w8001_set_devdata(struct input_dev *dev, struct w8001 *w8001,
 	dev->open = w8001_open;
 	dev->close = w8001_close;
 
-	dev->dev.parent = &serio->dev;
+	dev->dev.parent = w8001->dev;
 
 	input_set_drvdata(dev, w8001);
 }
 
+/*
+ * Query the tablet and set up the pen and touch input devices for what
+ * it supports; the ones it doesn't are freed and cleared.
+ */
+static int w8001_setup(struct w8001 *w8001)
+{
+	char basename[64] = "Wacom Serial";
+	int err, err_pen, err_touch;
+
+	err = w8001_detect(w8001);
+	if (err)
+		return err;
+
+	/* For backwards-compatibility we compose the basename based on
+	 * capabilities and then just append the tool type
+	 */
+	err_pen = w8001_setup_pen(w8001, basename, sizeof(basename));
+	err_touch = w8001_setup_touch(w8001, basename, sizeof(basename));
+	if (err_pen && err_touch)
+		return -ENXIO;
+
+	if (!err_pen) {
+		snprintf(w8001->pen_name, sizeof(w8001->pen_name),
+			 "%s Pen", basename);
+		w8001->pen_dev->name = w8001->pen_name;
+
+		w8001_set_devdata(w8001->pen_dev, w8001);
+	} else {
+		input_free_device(w8001->pen_dev);
+		w8001->pen_dev = NULL;
+	}
+
+	if (!err_touch) {
+		snprintf(w8001->touch_name, sizeof(w8001->touch_name),
+			 "%s Finger", basename);
+		w8001->touch_dev->name = w8001->touch_name;
+
+		w8001_set_devdata(w8001->touch_dev, w8001);
+	} else {
+		input_free_device(w8001->touch_dev);
+		w8001->touch_dev = NULL;
+	}
+
+	return 0;
+}
+
 /*
  * w8001_disconnect() is the opposite of w8001_connect()
  */
@@ -595,8 +793,7 @@ static int w8001_connect(struct serio *serio, struct serio_driver *drv)
 	struct w8001 *w8001;
 	struct input_dev *input_dev_pen;
 	struct input_dev *input_dev_touch;
-	char basename[64] = "Wacom Serial";
-	int err, err_pen, err_touch;
+	int err;
 
 	w8001 = kzalloc(sizeof(*w8001), GFP_KERNEL);
 	input_dev_pen = input_allocate_device();
@@ -607,6 +804,7 @@ static int w8001_connect(struct serio *serio, struct serio_driver *drv)
 	}
 
 	w8001->serio = serio;
+	w8001->dev = &serio->dev;
 	w8001->pen_dev = input_dev_pen;
 	w8001->touch_dev = input_dev_touch;
 	mutex_init(&w8001->mutex);
@@ -618,50 +816,22 @@ static int w8001_connect(struct serio *serio, struct serio_driver *drv)
 	if (err)
 		goto fail2;
 
-	err = w8001_detect(w8001);
+	err = w8001_setup(w8001);
+	input_dev_pen = w8001->pen_dev;
+	input_dev_touch = w8001->touch_dev;
 	if (err)
 		goto fail3;
 
-	/* For backwards-compatibility we compose the basename based on
-	 * capabilities and then just append the tool type
-	 */
-	err_pen = w8001_setup_pen(w8001, basename, sizeof(basename));
-	err_touch = w8001_setup_touch(w8001, basename, sizeof(basename));
-	if (err_pen && err_touch) {
-		err = -ENXIO;
-		goto fail3;
-	}
-
-	if (!err_pen) {
-		snprintf(w8001->pen_name, sizeof(w8001->pen_name),
-			 "%s Pen", basename);
-		input_dev_pen->name = w8001->pen_name;
-
-		w8001_set_devdata(input_dev_pen, w8001, serio);
-
+	if (w8001->pen_dev) {
 		err = input_register_device(w8001->pen_dev);
 		if (err)
 			goto fail3;
-	} else {
-		input_free_device(input_dev_pen);
-		input_dev_pen = NULL;
-		w8001->pen_dev = NULL;
 	}
 
-	if (!err_touch) {
-		snprintf(w8001->touch_name, sizeof(w8001->touch_name),
-			 "%s Finger", basename);
-		input_dev_touch->name = w8001->touch_name;
-
-		w8001_set_devdata(input_dev_touch, w8001, serio);
-
+	if (w8001->touch_dev) {
 		err = input_register_device(w8001->touch_dev);
 		if (err)
 			goto fail4;
-	} else {
-		input_free_device(input_dev_touch);
-		input_dev_touch = NULL;
-		w8001->touch_dev = NULL;
 	}
 
 	return 0;
@@ -703,4 +873,168 @@ static struct serio_driver w8001_drv = {
 	.disconnect	= w8001_disconnect,
 };
 
-module_serio_driver(w8001_drv);
+#if IS_ENABLED(CONFIG_SERIAL_DEV_BUS)
+#ifdef WACOM_SERDEV_RECEIVE_BUF_SIZE_T
+static size_t w8001_receive_buf(struct serdev_device *serdev,
+				const u8 *buf, size_t count)
+#else
+static int w8001_receive_buf(struct serdev_device *serdev,
+			     const unsigned char *buf, size_t count)
+#endif
+{
+	struct w8001 *w8001 = serdev_device_get_drvdata(serdev);
+
+	w8001_receive(w8001, buf, count);
+
+	return count;
+}
+
+static const struct serdev_device_ops w8001_serdev_ops = {
+	.receive_buf	= w8001_receive_buf,
+	.write_wakeup	= serdev_device_write_wakeup,
+};
+
+/* /sys/kernel/debug/w8001, with one directory per serdev device */
+static struct dentry *w8001_debugfs_root;
+
+static void w8001_debugfs_remove(void *data)
+{
+	struct w8001 *w8001 = data;
+
+	debugfs_remove_recursive(w8001->debugfs);
+}
+
+static int w8001_debugfs_init(struct w8001 *w8001)
+{
+	w8001->debugfs = debugfs_create_dir(dev_name(w8001->dev),
+					    w8001_debugfs_root);
+	debugfs_create_u32("resyncs", 0444, w8001->debugfs, &w8001->resyncs);
+
+	return devm_add_action_or_reset(w8001->dev, w8001_debugfs_remove,
+					w8001);
+}
+
+static int w8001_serdev_probe(struct serdev_device *serdev)
+{
+	struct device *dev = &serdev->dev;
+	struct w8001 *w8001;
+	u32 speed = W8001_DEFAULT_SPEED;
+	int err;
+
+	w8001 = devm_kzalloc(dev, sizeof(*w8001), GFP_KERNEL);
+	if (!w8001)
+		return -ENOMEM;
+
+	w8001->serdev = serdev;
+	w8001->dev = dev;
+	w8001->pen_dev = devm_input_allocate_device(dev);
+	w8001->touch_dev = devm_input_allocate_device(dev);
+	if (!w8001->pen_dev || !w8001->touch_dev)
+		return -ENOMEM;
+
+	mutex_init(&w8001->mutex);
+	init_completion(&w8001->cmd_done);
+	snprintf(w8001->phys, sizeof(w8001->phys), "%s/input0", dev_name(dev));
+
+	err = w8001_debugfs_init(w8001);
+	if (err)
+		return err;
+
+	serdev_device_set_drvdata(serdev, w8001);
+	serdev_device_set_client_ops(serdev, &w8001_serdev_ops);
+
+	err = devm_serdev_device_open(dev, serdev);
+	if (err)
+		return err;
+
+	device_property_read_u32(dev, "current-speed", &speed);
+	serdev_device_set_baudrate(serdev, speed);
+	serdev_device_set_flow_control(serdev, false);
+
+	err = w8001_setup(w8001);
+	if (err)
+		return err;
+
+	if (w8001->pen_dev) {
+		err = input_register_device(w8001->pen_dev);
+		if (err)
+			return err;
+	}
+
+	if (w8001->touch_dev) {
+		err = input_register_device(w8001->touch_dev);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+#ifdef CONFIG_OF
+static const struct of_device_id w8001_of_match[] = {
+	{ .compatible = "wacom,w8001" },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, w8001_of_match);
+#endif
+
+static struct serdev_device_driver w8001_serdev_drv = {
+	.driver		= {
+		.name	= "w8001",
+		.of_match_table = of_match_ptr(w8001_of_match),
+	},
+	.probe		= w8001_serdev_probe,
+};
+
+static int w8001_serdev_register(void)
+{
+	int error;
+
+	w8001_debugfs_root = debugfs_create_dir("w8001", NULL);
+
+	error = serdev_device_driver_register(&w8001_serdev_drv);
+	if (error)
+		debugfs_remove_recursive(w8001_debugfs_root);
+
+	return error;
+}
+
+static void w8001_serdev_unregister(void)
+{
+	serdev_device_driver_unregister(&w8001_serdev_drv);
+	debugfs_remove_recursive(w8001_debugfs_root);
+}
+#else
+static int w8001_serdev_register(void)
+{
+	return 0;
+}
+
+static void w8001_serdev_unregister(void)
+{
+}
+#endif
+
+static int __init w8001_init(void)
+{
+	int error;
+
+	error = serio_register_driver(&w8001_drv);
+	if (error)
+		return error;
+
+	error = w8001_serdev_register();
+	if (error)
+		serio_unregister_driver(&w8001_drv);
+
+	return error;
+}
+
+static void __exit w8001_exit(void)
+{
+	w8001_serdev_unregister();
+	serio_unregister_driver(&w8001_drv);
+}
+
+module_init(w8001_init);
+module_exit(w8001_exit);
@@ -42,9 +42,56 @@ static bool touch_arbitration = 1;
 module_param(touch_arbitration, bool, 0644);
 MODULE_PARM_DESC(touch_arbitration, " on (Y) off (N)");
 
+static unsigned int idleprox_timeout = 100;
+module_param(idleprox_timeout, uint, 0644);
+MODULE_PARM_DESC(idleprox_timeout, " ms without in-range report before a pen is forced out of prox (0 disables)");
+
+static unsigned int battery_notify_interval = 5000;
+module_param(battery_notify_interval, uint, 0644);
+MODULE_PARM_DESC(battery_notify_interval, " minimum ms between battery capacity uevents");
+
+/* capacity change, in percent, worth an immediate uevent */
+#define WACOM_BATTERY_HYSTERESIS	2
+
+/*
+ * Pen/touch arbitration state shared between sibling interfaces. The
+ * pen and touch interfaces are separate HID devices whose reports may
+ * be processed concurrently on different CPUs. Each side only writes
+ * its own flag and reads the sibling's without locking: a stale read
+ * merely delays arbitration until the next report. The flags are only
+ * stored when they actually change so that the sibling's cache line is
+ * not invalidated on every report.
+ */
+static inline bool wacom_shared_pen_prox(struct wacom_shared *shared)
+{
+	return READ_ONCE(shared->stylus_in_proximity);
+}
+
+static inline bool wacom_shared_touch_down(struct wacom_shared *shared)
+{
+	return READ_ONCE(shared->touch_down);
+}
+
+static inline void wacom_shared_set_pen_prox(struct wacom_shared *shared,
+					     bool prox)
+{
+	if (READ_ONCE(shared->stylus_in_proximity) != prox)
+		WRITE_ONCE(shared->stylus_in_proximity, prox);
+}
+
+static inline void wacom_shared_set_touch_down(struct wacom_shared *shared,
+					       bool down)
+{
+	if (READ_ONCE(shared->touch_down) != down)
+		WRITE_ONCE(shared->touch_down, down);
+}
+
 static void wacom_report_numbered_buttons(struct input_dev *input_dev,
 				int button_count, int mask);
 
+static void wacom_report_button_changes(struct input_dev *input_dev,
+				int button_count, int mask, u32 *last);
+
 static int wacom_numbered_button_to_key(int n);
 
 static void wacom_update_led(struct wacom *wacom, int button_count, int mask,
@@ -54,7 +101,7 @@ static void wacom_force_proxout(struct wacom_wac *wacom_wac)
 {
 	struct input_dev *input = wacom_wac->pen_input;
 
-	wacom_wac->shared->stylus_in_proximity = 0;
+	wacom_shared_set_pen_prox(wacom_wac->shared, false);
 
 	input_report_key(input, BTN_TOUCH, 0);
 	input_report_key(input, BTN_STYLUS, 0);
@@ -81,8 +128,20 @@ void wacom_idleprox_timeout(struct timer_list *list)
 	struct wacom *wacom = from_timer(wacom, list, idleprox_timer);
 #endif
 	struct wacom_wac *wacom_wac = &wacom->wacom_wac;
+	unsigned int timeout = READ_ONCE(idleprox_timeout);
+	unsigned long deadline;
 
-	if (!wacom_wac->hid_data.sense_state) {
+	if (!timeout || !wacom_wac->hid_data.sense_state) {
+		return;
+	}
+
+	/*
+	 * The report path only records when the pen was last seen in
+	 * range; push the timer out lazily if it has been since.
+	 */
+	deadline = READ_ONCE(wacom->idleprox_last) + msecs_to_jiffies(timeout);
+	if (time_before(jiffies, deadline)) {
+		mod_timer(&wacom->idleprox_timer, deadline);
 		return;
 	}
 
@@ -90,6 +149,16 @@ void wacom_idleprox_timeout(struct timer_list *list)
 	wacom_force_proxout(wacom_wac);
 }
 
+static void wacom_idleprox_touch(struct wacom *wacom)
+{
+	unsigned int timeout = READ_ONCE(idleprox_timeout);
+
+	WRITE_ONCE(wacom->idleprox_last, jiffies);
+	if (timeout && !timer_pending(&wacom->idleprox_timer))
+		mod_timer(&wacom->idleprox_timer,
+			  jiffies + msecs_to_jiffies(timeout));
+}
+
 /*
  * Percent of battery capacity for Graphire.
  * 8th value means AC online and show 100% capacity.
@@ -101,27 +170,64 @@ static unsigned short batcap_gr[8] = { 1, 15, 25, 35, 50, 70, 100, 100 };
  */
 static unsigned short batcap_i4[8] = { 1, 15, 30, 45, 60, 70, 85, 100 };
 
+static void wacom_battery_changed(struct wacom_battery *battery)
+{
+	battery->notified_capacity = battery->battery_capacity;
+	battery->notified_at = jiffies;
+	power_supply_changed(battery->battery);
+}
+
+void wacom_battery_notify_work(struct work_struct *work)
+{
+	struct wacom_battery *battery =
+		container_of(work, struct wacom_battery, notify_work.work);
+
+	if (battery->battery &&
+	    battery->notified_capacity != battery->battery_capacity)
+		wacom_battery_changed(battery);
+}
+
+/*
+ * State transitions (status, charging, connection) are signalled right
+ * away. Capacity updates are rate limited: small changes, or any change
+ * within battery_notify_interval of the previous uevent, are left to a
+ * deferred flush so a value flapping between two percentages doesn't
+ * wake userspace on every report.
+ */
 static void __wacom_notify_battery(struct wacom_battery *battery,
 				   int bat_status, int bat_capacity,
 				   bool bat_charging, bool bat_connected,
 				   bool ps_connected)
 {
 	bool changed = battery->bat_status       != bat_status    ||
-		       battery->battery_capacity != bat_capacity  ||
 		       battery->bat_charging     != bat_charging  ||
 		       battery->bat_connected    != bat_connected ||
 		       battery->ps_connected     != ps_connected;
+	unsigned long interval = msecs_to_jiffies(READ_ONCE(battery_notify_interval));
+
+	if (!changed && battery->battery_capacity == bat_capacity)
+		return;
 
-	if (changed) {
-		battery->bat_status = bat_status;
-		battery->battery_capacity = bat_capacity;
-		battery->bat_charging = bat_charging;
-		battery->bat_connected = bat_connected;
-		battery->ps_connected = ps_connected;
+	battery->bat_status = bat_status;
+	battery->battery_capacity = bat_capacity;
+	battery->bat_charging = bat_charging;
+	battery->bat_connected = bat_connected;
+	battery->ps_connected = ps_connected;
 
-		if (battery->battery)
-			power_supply_changed(battery->battery);
+	if (!battery->battery)
+		return;
+
+	if (changed ||
+	    (abs(bat_capacity - battery->notified_capacity) >= WACOM_BATTERY_HYSTERESIS &&
+	     time_after_eq(jiffies, battery->notified_at + interval))) {
+		wacom_battery_changed(battery);
+		return;
 	}
+
+	battery->wacom->stats.battery_notify_suppressed++;
+	if (!delayed_work_pending(&battery->notify_work))
+		queue_delayed_work(system_power_efficient_wq,
+				   &battery->notify_work, interval);
 }
 
 static void wacom_notify_battery(struct wacom_wac *wacom_wac,
@@ -810,14 +916,14 @@ static int wacom_intuos_inout(struct wacom_wac *wacom)
 
 		wacom->tool[idx] = wacom_intuos_get_tool_type(wacom->id[idx]);
 
-		wacom->shared->stylus_in_proximity = true;
+		wacom_shared_set_pen_prox(wacom->shared, true);
 		return 1;
 	}
 
 	/* in Range */
 	if ((data[1] & 0xfe) == 0x20) {
 		if (features->type != INTUOSHT2)
-			wacom->shared->stylus_in_proximity = true;
+			wacom_shared_set_pen_prox(wacom->shared, true);
 
 		/* in Range while exiting */
 		if (wacom->reporting_data) {
@@ -831,7 +937,7 @@ static int wacom_intuos_inout(struct wacom_wac *wacom)
 
 	/* Exit report */
 	if ((data[1] & 0xfe) == 0x80) {
-		wacom->shared->stylus_in_proximity = false;
+		wacom_shared_set_pen_prox(wacom->shared, false);
 		wacom->reporting_data = false;
 
 		/* don't report exit if we don't know the ID */
@@ -854,12 +960,12 @@ static inline bool touch_is_muted(struct wacom_wac *wacom_wac)
 
 static inline bool report_touch_events(struct wacom_wac *wacom)
 {
-	return (touch_arbitration ? !wacom->shared->stylus_in_proximity : 1);
+	return (touch_arbitration ? !wacom_shared_pen_prox(wacom->shared) : 1);
 }
 
 static inline bool delay_pen_events(struct wacom_wac *wacom)
 {
-	return (wacom->shared->touch_down && touch_arbitration);
+	return (wacom_shared_touch_down(wacom->shared) && touch_arbitration);
 }
 
 static int wacom_intuos_general(struct wacom_wac *wacom)
@@ -1072,16 +1178,44 @@ static int wacom_intuos_irq(struct wacom_wac *wacom)
 	return 0;
 }
 
+static int wacom_remote_find(struct wacom_remote *remote, u32 serial)
+{
+	unsigned int index = READ_ONCE(remote->last_index);
+	int i;
+
+	/* packets usually keep coming from the same remote */
+	if (READ_ONCE(remote->remotes[index].serial) == serial)
+		return index;
+
+	for (i = 0; i < WACOM_MAX_REMOTES; i++) {
+		if (READ_ONCE(remote->remotes[i].serial) == serial) {
+			WRITE_ONCE(remote->last_index, i);
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Reports input without remote->remote_lock: wacom_remote_work()
+ * publishes a remote's input device through remotes[].active only once
+ * it is registered, and waits for an RCU grace period after unpublishing
+ * it before tearing it down. Only the battery notification, which may
+ * raise a uevent, is taken out of the RCU section and under the lock.
+ */
 static int wacom_remote_irq(struct wacom_wac *wacom_wac, size_t len)
 {
 	unsigned char *data = wacom_wac->data;
 	struct input_dev *input;
 	struct wacom *wacom = container_of(wacom_wac, struct wacom, wacom_wac);
 	struct wacom_remote *remote = wacom->remote;
+	struct wacom_battery *battery;
 	int bat_charging, bat_percent, touch_ring_mode;
-	__u32 serial;
-	int i, index = -1;
+	int buttons;
 	unsigned long flags;
+	__u32 serial;
+	int i, index;
 
 	if (data[0] != WACOM_REPORT_REMOTE) {
 		hid_dbg(wacom->hdev, "%s: received unknown report #%d",
@@ -1092,51 +1226,40 @@ static int wacom_remote_irq(struct wacom_wac *wacom_wac, size_t len)
 	serial = data[3] + (data[4] << 8) + (data[5] << 16);
 	wacom_wac->id[0] = PAD_DEVICE_ID;
 
-	spin_lock_irqsave(&remote->remote_lock, flags);
+	rcu_read_lock();
 
-	for (i = 0; i < WACOM_MAX_REMOTES; i++) {
-		if (remote->remotes[i].serial == serial) {
-			index = i;
-			break;
-		}
+	index = wacom_remote_find(remote, serial);
+	if (index < 0) {
+		rcu_read_unlock();
+		return 0;
 	}
 
-	if (index < 0 || !remote->remotes[index].registered)
-		goto out;
-
-	remote->remotes[i].active_time = ktime_get();
-	input = remote->remotes[index].input;
-
-	input_report_key(input, BTN_0, (data[9] & 0x01));
-	input_report_key(input, BTN_1, (data[9] & 0x02));
-	input_report_key(input, BTN_2, (data[9] & 0x04));
-	input_report_key(input, BTN_3, (data[9] & 0x08));
-	input_report_key(input, BTN_4, (data[9] & 0x10));
-	input_report_key(input, BTN_5, (data[9] & 0x20));
-	input_report_key(input, BTN_6, (data[9] & 0x40));
-	input_report_key(input, BTN_7, (data[9] & 0x80));
+	/*
+	 * The slot may have been unpaired and reused since the lookup; only
+	 * trust the input if it still belongs to this serial.
+	 */
+	input = rcu_dereference(remote->remotes[index].active);
+	if (!input || READ_ONCE(remote->remotes[index].serial) != serial) {
+		rcu_read_unlock();
+		return 0;
+	}
 
-	input_report_key(input, BTN_8, (data[10] & 0x01));
-	input_report_key(input, BTN_9, (data[10] & 0x02));
-	input_report_key(input, BTN_A, (data[10] & 0x04));
-	input_report_key(input, BTN_B, (data[10] & 0x08));
-	input_report_key(input, BTN_C, (data[10] & 0x10));
-	input_report_key(input, BTN_X, (data[10] & 0x20));
-	input_report_key(input, BTN_Y, (data[10] & 0x40));
-	input_report_key(input, BTN_Z, (data[10] & 0x80));
+	WRITE_ONCE(remote->remotes[index].active_time, ktime_get());
 
-	input_report_key(input, BTN_BASE, (data[11] & 0x01));
-	input_report_key(input, BTN_BASE2, (data[11] & 0x02));
+	/*
+	 * The 18 remote buttons (BTN_0..BTN_9, BTN_A..BTN_Z and
+	 * BTN_BASE..BTN_BASE2) follow the numbered-button layout.
+	 */
+	buttons = data[9] | (data[10] << 8) | ((data[11] & 0x03) << 16);
+	wacom_report_button_changes(input, 18, buttons,
+				    &remote->remotes[index].buttons);
 
 	if (data[12] & 0x80)
 		input_report_abs(input, ABS_WHEEL, (data[12] & 0x7f) - 1);
 	else
 		input_report_abs(input, ABS_WHEEL, 0);
 
-	bat_percent = data[7] & 0x7f;
-	bat_charging = !!(data[7] & 0x80);
-
-	if (data[9] | data[10] | (data[11] & 0x03) | data[12])
+	if (buttons | data[12])
 		input_report_abs(input, ABS_MISC, PAD_DEVICE_ID);
 	else
 		input_report_abs(input, ABS_MISC, 0);
@@ -1145,23 +1268,60 @@ static int wacom_remote_irq(struct wacom_wac *wacom_wac, size_t len)
 
 	input_sync(input);
 
+	bat_percent = data[7] & 0x7f;
+	bat_charging = !!(data[7] & 0x80);
+	battery = &remote->remotes[index].battery;
+
+	rcu_read_unlock();
+
+	/*
+	 * The battery lives in remote->remotes[] for as long as the receiver
+	 * does; remote_lock keeps wacom_remote_destroy_battery() from
+	 * unregistering its power supply while we notify it.
+	 */
+	spin_lock_irqsave(&remote->remote_lock, flags);
+	__wacom_notify_battery(battery, WACOM_POWER_SUPPLY_STATUS_AUTO,
+			       bat_percent, bat_charging, 1, bat_charging);
+	spin_unlock_irqrestore(&remote->remote_lock, flags);
+
 	/*Which mode select (LED light) is currently on?*/
 	touch_ring_mode = (data[11] & 0xC0) >> 6;
 
 	for (i = 0; i < WACOM_MAX_REMOTES; i++) {
-		if (remote->remotes[i].serial == serial)
+		if (READ_ONCE(remote->remotes[i].serial) == serial)
 			wacom->led.groups[i].select = touch_ring_mode;
 	}
 
-	__wacom_notify_battery(&remote->remotes[index].battery,
-				WACOM_POWER_SUPPLY_STATUS_AUTO, bat_percent,
-				bat_charging, 1, bat_charging);
-
-out:
-	spin_unlock_irqrestore(&remote->remote_lock, flags);
 	return 0;
 }
 
+/*
+ * Batteries are attached once a paired remote has reported, and dropped
+ * again when it stays silent for WACOM_REMOTE_BATTERY_TIMEOUT.
+ */
+static bool wacom_remote_battery_due(struct wacom *wacom)
+{
+	struct wacom_remote *remote = wacom->remote;
+	ktime_t kt = ktime_get();
+	int i;
+
+	for (i = 0; i < WACOM_MAX_REMOTES; i++) {
+		ktime_t active_time = READ_ONCE(remote->remotes[i].active_time);
+
+		if (!READ_ONCE(remote->remotes[i].registered) || !active_time)
+			continue;
+
+		if (READ_ONCE(remote->remotes[i].battery.battery)) {
+			if (kt - active_time > WACOM_REMOTE_BATTERY_TIMEOUT)
+				return true;
+		} else if (wacom->led.groups[i].select != WACOM_STATUS_UNKNOWN) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static void wacom_remote_status_irq(struct wacom_wac *wacom_wac, size_t len)
 {
 	struct wacom *wacom = container_of(wacom_wac, struct wacom, wacom_wac);
@@ -1185,6 +1345,14 @@ static void wacom_remote_status_irq(struct wacom_wac *wacom_wac, size_t len)
 
 	spin_lock_irqsave(&remote->remote_lock, flags);
 
+	/* the receiver repeats the device list; only queue changes */
+	if (!memcmp(&remote->last_status, &remote_data, sizeof(remote_data))) {
+		spin_unlock_irqrestore(&remote->remote_lock, flags);
+		if (wacom_remote_battery_due(wacom))
+			wacom_schedule_work(wacom_wac, WACOM_WORKER_REMOTE);
+		return;
+	}
+
 	ret = kfifo_in(&remote->remote_fifo, &remote_data, sizeof(remote_data));
 	if (ret != sizeof(remote_data)) {
 		spin_unlock_irqrestore(&remote->remote_lock, flags);
@@ -1192,6 +1360,8 @@ static void wacom_remote_status_irq(struct wacom_wac *wacom_wac, size_t len)
 		return;
 	}
 
+	remote->last_status = remote_data;
+
 	spin_unlock_irqrestore(&remote->remote_lock, flags);
 
 	wacom_schedule_work(wacom_wac, WACOM_WORKER_REMOTE);
@@ -1350,7 +1520,7 @@ static void wacom_intuos_pro2_bt_pen(struct wacom_wac *wacom)
 			continue;
 
 		if (!prox) {
-			wacom->shared->stylus_in_proximity = false;
+			wacom_shared_set_pen_prox(wacom->shared, false);
 			wacom_exit_report(wacom);
 			input_sync(pen_input);
 
@@ -1418,7 +1588,7 @@ static void wacom_intuos_pro2_bt_pen(struct wacom_wac *wacom)
 					 wacom_intuos_id_mangle(wacom->id[0])); /* report tool id */
 		}
 
-		wacom->shared->stylus_in_proximity = prox;
+		wacom_shared_set_pen_prox(wacom->shared, prox);
 
 #ifdef WACOM_INPUT_SET_TIMESTAMP
 		/* add timestamp to unpack the frames */
@@ -1481,7 +1651,8 @@ static void wacom_intuos_pro2_bt_touch(struct wacom_wac *wacom)
 		wacom->num_contacts_left -= contacts_to_send;
 		if (wacom->num_contacts_left <= 0) {
 			wacom->num_contacts_left = 0;
-			wacom->shared->touch_down = wacom_wac_finger_count_touches(wacom);
+			wacom_shared_set_touch_down(wacom->shared,
+						wacom_wac_finger_count_touches(wacom));
 			input_sync(touch_input);
 		}
 	}
@@ -1597,7 +1768,7 @@ static int wacom_24hdt_irq(struct wacom_wac *wacom)
 	int byte_per_packet = WACOM_BYTES_PER_24HDT_PACKET;
 	int y_offset = 2;
 
-	if (touch_is_muted(wacom) && !wacom->shared->touch_down)
+	if (touch_is_muted(wacom) && !wacom_shared_touch_down(wacom->shared))
 		return 0;
 
 	if (wacom->features.type == WACOM_27QHDT) {
@@ -1652,7 +1823,8 @@ static int wacom_24hdt_irq(struct wacom_wac *wacom)
 	wacom->num_contacts_left -= contacts_to_send;
 	if (wacom->num_contacts_left <= 0) {
 		wacom->num_contacts_left = 0;
-		wacom->shared->touch_down = wacom_wac_finger_count_touches(wacom);
+		wacom_shared_set_touch_down(wacom->shared,
+					wacom_wac_finger_count_touches(wacom));
 	}
 	return 1;
 }
@@ -1703,7 +1875,8 @@ static int wacom_mt_touch(struct wacom_wac *wacom)
 	wacom->num_contacts_left -= contacts_to_send;
 	if (wacom->num_contacts_left <= 0) {
 		wacom->num_contacts_left = 0;
-		wacom->shared->touch_down = wacom_wac_finger_count_touches(wacom);
+		wacom_shared_set_touch_down(wacom->shared,
+					wacom_wac_finger_count_touches(wacom));
 	}
 	return 1;
 }
@@ -1731,7 +1904,8 @@ static int wacom_tpc_mt_touch(struct wacom_wac *wacom)
 	input_mt_sync_frame(input);
 
 	/* keep touch state for pen event */
-	wacom->shared->touch_down = wacom_wac_finger_count_touches(wacom);
+	wacom_shared_set_touch_down(wacom->shared,
+				wacom_wac_finger_count_touches(wacom));
 
 	return 1;
 }
@@ -1767,7 +1941,7 @@ static int wacom_tpc_single_touch(struct wacom_wac *wacom, size_t len)
 	input_report_key(input, BTN_TOUCH, prox);
 
 	/* keep touch state for pen events */
-	wacom->shared->touch_down = prox;
+	wacom_shared_set_touch_down(wacom->shared, prox);
 
 	return 1;
 }
@@ -1778,12 +1952,12 @@ static int wacom_tpc_pen(struct wacom_wac *wacom)
 	struct input_dev *input = wacom->pen_input;
 	bool prox = data[1] & 0x20;
 
-	if (!wacom->shared->stylus_in_proximity) /* first in prox */
+	if (!wacom_shared_pen_prox(wacom->shared)) /* first in prox */
 		/* Going into proximity select tool */
 		wacom->tool[0] = (data[1] & 0x0c) ? BTN_TOOL_RUBBER : BTN_TOOL_PEN;
 
 	/* keep pen state for touch events */
-	wacom->shared->stylus_in_proximity = prox;
+	wacom_shared_set_pen_prox(wacom->shared, prox);
 
 	/* send pen events only when touch is up or forced out
 	 * or touch arbitration is off
@@ -1844,20 +2018,88 @@ static int wacom_tpc_irq(struct wacom_wac *wacom, size_t len)
 	return 0;
 }
 
-static int wacom_offset_rotation(struct input_dev *input, struct hid_usage *usage,
-				 int value, int num, int denom)
+/*
+ * Set up a transform which optionally inverts the value and then rotates
+ * it by num/denom of the field's range, wrapping around at the ends. The
+ * rotation is reduced to less than one turn here so that a single
+ * compare is enough to wrap the result per event.
+ */
+static void wacom_xform_init_rotation(struct wacom_value_xform *xform,
+				      struct hid_field *field, bool invert,
+				      int num, int denom)
+{
+	int range = field->logical_maximum - field->logical_minimum + 1;
+
+	xform->mul = invert ? -1 : 1;
+	xform->div = 1;
+	xform->add = (invert ? field->logical_maximum : 0) +
+		     (num * range / denom) % range;
+	xform->min = field->logical_minimum;
+	xform->range = range;
+	xform->lowres_code = 0;
+}
+
+/*
+ * Set up a transform which scales a relative wheel to hi-res units of
+ * 1/120th of a detent, optionally flipping its sign.
+ */
+static void wacom_xform_init_hires(struct wacom_value_xform *xform,
+				   struct hid_usage *usage, bool invert,
+				   __u16 lowres_code)
+{
+#ifdef WACOM_RESOLUTION_MULTIPLIER
+	int div = usage->resolution_multiplier ?: 1;
+
+	/* multipliers normally divide 120, leaving a plain multiply */
+	xform->mul = 120;
+	xform->div = div;
+	if (120 % div == 0) {
+		xform->mul = 120 / div;
+		xform->div = 1;
+	}
+	if (invert)
+		xform->mul = -xform->mul;
+#else
+	xform->mul = invert ? -1 : 1;
+	xform->div = 1;
+#endif
+	xform->add = 0;
+	xform->min = 0;
+	xform->range = 0;
+	xform->lowres_code = lowres_code;
+}
+
+static inline int wacom_apply_xform(const struct wacom_value_xform *xform,
+				    int value)
 {
-	struct input_absinfo *abs = &input->absinfo[usage->code];
-	int range = (abs->maximum - abs->minimum + 1);
-
-	value += num*range/denom;
-	if (value > abs->maximum)
-		value -= range;
-	else if (value < abs->minimum)
-		value += range;
+	value *= xform->mul;
+	if (unlikely(xform->div != 1))
+		value /= xform->div;
+	value += xform->add;
+
+	if (xform->range) {
+		if (value >= xform->min + xform->range)
+			value -= xform->range;
+		else if (value < xform->min)
+			value += xform->range;
+	}
+
 	return value;
 }
 
+/*
+ * Touch ring transforms are stored with absolute rings in slots 0/1
+ * and relative rings in slots 2/3, in the order they were mapped.
+ */
+static inline int wacom_ring_xform_index(struct hid_field *field,
+					 struct hid_usage *usage)
+{
+	bool relative = field->flags & HID_MAIN_ITEM_RELATIVE;
+	bool second = usage->code == (relative ? REL_HWHEEL_HI_RES : ABS_THROTTLE);
+
+	return (relative << 1) | second;
+}
+
 int wacom_equivalent_usage(int usage)
 {
 	if ((usage & HID_USAGE_PAGE) == WACOM_HID_UP_WACOMDIGITIZER) {
@@ -2089,17 +2331,51 @@ static void wacom_wac_pad_usage_mapping(struct hid_device *hdev,
 			if (wacom_wac->relring_count == 1) {
 				wacom_map_usage(input, usage, field, EV_REL, REL_WHEEL_HI_RES, 0);
 				set_bit(REL_WHEEL, input->relbit);
+				/* We must invert the sign for vertical
+				 * relative scrolling. Clockwise
+				 * rotation produces positive values
+				 * from HW, but userspace treats
+				 * positive REL_WHEEL as a scroll *up*!
+				 */
+				wacom_xform_init_hires(&wacom_wac->ring_xform[2],
+						       usage, true, REL_WHEEL);
 			}
 			else if (wacom_wac->relring_count == 2) {
 				wacom_map_usage(input, usage, field, EV_REL, REL_HWHEEL_HI_RES, 0);
 				set_bit(REL_HWHEEL, input->relbit);
+				/* No need to invert the sign for
+				 * horizontal relative scrolling.
+				 * Clockwise rotation produces positive
+				 * values from HW and userspace treats
+				 * positive REL_HWHEEL as a scroll
+				 * right.
+				 */
+				wacom_xform_init_hires(&wacom_wac->ring_xform[3],
+						       usage, false, REL_HWHEEL);
 			}
 		} else {
+			/*
+			 * Userspace expects touchrings to increase in value with
+			 * clockwise gestures and have their zero point at the
+			 * tablet's left. HID events "should" be clockwise-
+			 * increasing and zero at top, though some devices
+			 * (e.g. the MobileStudio Pro and 2nd-gen Intuos Pro)
+			 * don't do this; their correction comes from the
+			 * device table.
+			 */
+			int num = features->ring_rotation_den ? features->ring_rotation_num : 1;
+			int denom = features->ring_rotation_den ? features->ring_rotation_den : 4;
+
 			wacom_wac->absring_count++;
 			if (wacom_wac->absring_count == 1)
 				wacom_map_usage(input, usage, field, EV_ABS, ABS_WHEEL, 0);
 			else if (wacom_wac->absring_count == 2)
 				wacom_map_usage(input, usage, field, EV_ABS, ABS_THROTTLE, 0);
+
+			if (wacom_wac->absring_count <= 2)
+				wacom_xform_init_rotation(
+					&wacom_wac->ring_xform[wacom_wac->absring_count - 1],
+					field, features->ring_invert, num, denom);
 		}
 		features->device_type |= WACOM_DEVICETYPE_PAD;
 		break;
@@ -2198,68 +2474,16 @@ static void wacom_wac_pad_event(struct hid_device *hdev, struct hid_field *field
 
 	switch (equivalent_usage) {
 	case WACOM_HID_WD_TOUCHRING:
-		/*
-		 * Userspace expects touchrings to increase in value with
-		 * clockwise gestures and have their zero point at the
-		 * tablet's left. HID events "should" be clockwise-
-		 * increasing and zero at top, though the MobileStudio
-		 * Pro and 2nd-gen Intuos Pro don't do this...
-		 */
-		if (hdev->vendor == 0x56a &&
-		    (hdev->product == 0x34d || hdev->product == 0x34e ||  /* MobileStudio Pro */
-		     hdev->product == 0x357 || hdev->product == 0x358 ||  /* Intuos Pro 2 */
-		     hdev->product == 0x392 ||				  /* Intuos Pro 2 */
-		     hdev->product == 0x398 || hdev->product == 0x399 ||  /* MobileStudio Pro */
-		     hdev->product == 0x3AA)) {				  /* MobileStudio Pro */
-			value = (field->logical_maximum - value);
-
-			if (hdev->product == 0x357 || hdev->product == 0x358 ||
-			    hdev->product == 0x392)
-				value = wacom_offset_rotation(input, usage, value, 3, 16);
-			else if (hdev->product == 0x34d || hdev->product == 0x34e ||
-				 hdev->product == 0x398 || hdev->product == 0x399 ||
-				 hdev->product == 0x3AA)
-				value = wacom_offset_rotation(input, usage, value, 1, 2);
-		}
-		else if (field->flags & HID_MAIN_ITEM_RELATIVE) {
-#ifdef WACOM_RESOLUTION_MULTIPLIER
-			int hires_value = value * 120 / usage->resolution_multiplier;
-#else
-			int hires_value = value;
-#endif
-			int *ring_value;
-			int lowres_code;
+	{
+		int index = wacom_ring_xform_index(field, usage);
+		const struct wacom_value_xform *xform = &wacom_wac->ring_xform[index];
 
-			if (usage->code == REL_WHEEL_HI_RES) {
-				/* We must invert the sign for vertical
-				 * relative scrolling. Clockwise
-				 * rotation produces positive values
-				 * from HW, but userspace treats
-				 * positive REL_WHEEL as a scroll *up*!
-				 */
-				hires_value = -hires_value;
-				ring_value = &wacom_wac->hid_data.ring_value;
-				lowres_code = REL_WHEEL;
-			}
-			else if (usage->code == REL_HWHEEL_HI_RES) {
-				/* No need to invert the sign for
-				 * horizontal relative scrolling.
-				 * Clockwise rotation produces positive
-				 * values from HW and userspace treats
-				 * positive REL_HWHEEL as a scroll
-				 * right.
-				 */
-				ring_value = &wacom_wac->hid_data.ring2_value;
-				lowres_code = REL_HWHEEL;
-			}
-			else {
-				hid_err(wacom->hdev, "unrecognized relative wheel with code %d\n",
-					usage->code);
-				break;
-			}
+		value = wacom_apply_xform(xform, value);
+
+		if (xform->lowres_code) {
+			int *ring_value = &wacom_wac->hid_data.ring_value[index & 1];
 
-			value = hires_value;
-			*ring_value += hires_value;
+			*ring_value += value;
 
 			/* Emulate a legacy wheel click for every 120
 			 * units of hi-res travel.
@@ -2267,15 +2491,13 @@ static void wacom_wac_pad_event(struct hid_device *hdev, struct hid_field *field
 			if (*ring_value >= 120 || *ring_value <= -120) {
 				int clicks = *ring_value / 120;
 
-				input_event(input, usage->type, lowres_code, clicks);
+				input_event(input, usage->type, xform->lowres_code, clicks);
 				*ring_value -= clicks * 120;
 			}
 		}
-		else {
-			value = wacom_offset_rotation(input, usage, value, 1, 4);
-		}
 		do_report = true;
 		break;
+	}
 	case WACOM_HID_WD_TOUCHRINGSTATUS:
 		if (!value)
 			input_event(input, usage->type, usage->code, 0);
@@ -2384,6 +2606,13 @@ static void wacom_wac_pen_usage_mapping(struct hid_device *hdev,
 		break;
 	case HID_DG_TWIST:
 		wacom_map_usage(input, usage, field, EV_ABS, ABS_Z, 0);
+		/*
+		 * Userspace expects pen twist to have its zero point when
+		 * the buttons/finger is on the tablet's left. HID values
+		 * are zero when buttons are toward the top.
+		 */
+		wacom_xform_init_rotation(&wacom_wac->twist_xform, field,
+					  false, 1, 4);
 		break;
 	case HID_DG_ERASER:
 		input_set_capability(input, EV_KEY, BTN_TOOL_RUBBER);
@@ -2456,7 +2685,7 @@ static void wacom_wac_pen_event(struct hid_device *hdev, struct hid_field *field
 		value = field->logical_maximum - value;
 		break;
 	case HID_DG_INRANGE:
-		mod_timer(&wacom->idleprox_timer, jiffies + msecs_to_jiffies(100));
+		wacom_idleprox_touch(wacom);
 		wacom_wac->hid_data.inrange_state = value;
 		if (!(features->quirks & WACOM_QUIRK_SENSE))
 			wacom_wac->hid_data.sense_state = value;
@@ -2484,14 +2713,9 @@ static void wacom_wac_pen_event(struct hid_device *hdev, struct hid_field *field
 		return;
 	case HID_DG_TWIST:
 		/* don't modify the value if the pen doesn't support the feature */
-		if (!wacom_is_art_pen(wacom_wac->id[0])) return;
+		if (!usage->type || !wacom_is_art_pen(wacom_wac->id[0])) return;
 
-		/*
-		 * Userspace expects pen twist to have its zero point when
-		 * the buttons/finger is on the tablet's left. HID values
-		 * are zero when buttons are toward the top.
-		 */
-		value = wacom_offset_rotation(input, usage, value, 1, 4);
+		value = wacom_apply_xform(&wacom_wac->twist_xform, value);
 		break;
 	case WACOM_HID_WD_SENSE:
 		wacom_wac->hid_data.sense_state = value;
@@ -2578,7 +2802,7 @@ static void wacom_wac_pen_event(struct hid_device *hdev, struct hid_field *field
 	/* send pen events only when the pen is in range */
 	if (wacom_wac->hid_data.inrange_state)
 		input_event(input, usage->type, usage->code, value);
-	else if (wacom_wac->shared->stylus_in_proximity && !wacom_wac->hid_data.sense_state)
+	else if (wacom_shared_pen_prox(wacom_wac->shared) && !wacom_wac->hid_data.sense_state)
 		input_event(input, usage->type, usage->code, 0);
 }
 
@@ -2618,7 +2842,7 @@ static void wacom_wac_pen_report(struct hid_device *hdev,
 	}
 
 	/* keep pen state for touch events */
-	wacom_wac->shared->stylus_in_proximity = sense;
+	wacom_shared_set_pen_prox(wacom_wac->shared, sense);
 
 	if (!delay_pen_events(wacom_wac) && wacom_wac->tool[0]) {
 		int id = wacom_wac->id[0];
@@ -2671,8 +2895,9 @@ static void wacom_wac_pen_report(struct hid_device *hdev,
 		if (entering_range)
 			cancel_delayed_work(&wacom->aes_battery_work);
 		if (!sense)
-			schedule_delayed_work(&wacom->aes_battery_work,
-					      msecs_to_jiffies(WACOM_AES_BATTERY_TIMEOUT));
+			queue_delayed_work(system_power_efficient_wq,
+					   &wacom->aes_battery_work,
+					   msecs_to_jiffies(WACOM_AES_BATTERY_TIMEOUT));
 	}
 
 	if (!sense) {
@@ -2745,7 +2970,7 @@ static void wacom_wac_finger_slot(struct wacom_wac *wacom_wac,
 	bool prox = touch_down && report_touch_events(wacom_wac);
 
 	if (touch_is_muted(wacom_wac)) {
-		if (!wacom_wac->shared->touch_down)
+		if (!wacom_shared_touch_down(wacom_wac->shared))
 			return;
 		prox = false;
 	}
@@ -2800,7 +3025,7 @@ static void wacom_wac_finger_event(struct hid_device *hdev,
 	unsigned equivalent_usage = wacom_equivalent_usage(usage->hid);
 	struct wacom_features *features = &wacom->wacom_wac.features;
 
-	if (touch_is_muted(wacom_wac) && !wacom_wac->shared->touch_down)
+	if (touch_is_muted(wacom_wac) && !wacom_shared_touch_down(wacom_wac->shared))
 		return;
 
 	if (wacom_wac->is_invalid_bt_frame)
@@ -2855,7 +3080,7 @@ static void wacom_wac_finger_pre_report(struct hid_device *hdev,
 	struct hid_data* hid_data = &wacom_wac->hid_data;
 	int i;
 
-	if (touch_is_muted(wacom_wac) && !wacom_wac->shared->touch_down)
+	if (touch_is_muted(wacom_wac) && !wacom_shared_touch_down(wacom_wac->shared))
 		return;
 
 	wacom_wac->is_invalid_bt_frame = false;
@@ -2937,7 +3162,8 @@ static void wacom_wac_finger_report(struct hid_device *hdev,
 	wacom_wac->hid_data.num_expected = 0;
 
 	/* keep touch state for pen event */
-	wacom_wac->shared->touch_down = wacom_wac_finger_count_touches(wacom_wac);
+	wacom_shared_set_touch_down(wacom_wac->shared,
+				wacom_wac_finger_count_touches(wacom_wac));
 }
 
 void wacom_wac_usage_mapping(struct hid_device *hdev,
@@ -3125,7 +3351,8 @@ static int wacom_bpt_touch(struct wacom_wac *wacom)
 	input_report_key(pad_input, BTN_FORWARD, (data[1] & 0x04) != 0);
 	input_report_key(pad_input, BTN_BACK, (data[1] & 0x02) != 0);
 	input_report_key(pad_input, BTN_RIGHT, (data[1] & 0x01) != 0);
-	wacom->shared->touch_down = wacom_wac_finger_count_touches(wacom);
+	wacom_shared_set_touch_down(wacom->shared,
+				wacom_wac_finger_count_touches(wacom));
 
 	return 1;
 }
@@ -3214,7 +3441,8 @@ static int wacom_bpt3_touch(struct wacom_wac *wacom)
 	/* only update touch if we actually have a touchpad and touch data changed */
 	if (wacom->touch_input && touch_changed) {
 		input_mt_sync_frame(wacom->touch_input);
-		wacom->shared->touch_down = wacom_wac_finger_count_touches(wacom);
+		wacom_shared_set_touch_down(wacom->shared,
+					wacom_wac_finger_count_touches(wacom));
 	}
 
 	return 1;
@@ -3236,7 +3464,7 @@ static int wacom_bpt_pen(struct wacom_wac *wacom)
 	prox = (data[1] & 0x40) == 0x40;
 	rdy = (data[1] & 0x20) == 0x20;
 
-	wacom->shared->stylus_in_proximity = range;
+	wacom_shared_set_pen_prox(wacom->shared, range);
 	if (delay_pen_events(wacom))
 		return 0;
 
@@ -3373,7 +3601,7 @@ static int wacom_bamboo_pad_touch_event(struct wacom_wac *wacom,
 	input_report_key(input, BTN_RIGHT, prefix & 0x80);
 
 	/* keep touch state for pen event */
-	wacom->shared->touch_down = !!prefix && report_touch_events(wacom);
+	wacom_shared_set_touch_down(wacom->shared, !!prefix && report_touch_events(wacom));
 
 	return 1;
 }
@@ -4170,11 +4398,19 @@ static void wacom_24hd_update_leds(struct wacom *wacom, int mask, int group)
 	}
 }
 
-static bool wacom_is_led_toggled(struct wacom *wacom, int button_count,
-				 int mask, int group)
+/*
+ * Returns the bits of the numbered-button mask which can affect the
+ * state of the given LED group.
+ */
+static int wacom_led_group_buttons(struct wacom *wacom, int button_count,
+				   int group)
 {
 	int group_button;
 
+	/* 24HD group 0 is driven by the second half of the buttons */
+	if (wacom->wacom_wac.features.type == WACOM_24HD)
+		return group == 0 ? 0x07 << 8 : 0x07;
+
 	/*
 	 * 21UX2 has LED group 1 to the left and LED group 0
 	 * to the right. We need to reverse the group to match this
@@ -4188,7 +4424,13 @@ static bool wacom_is_led_toggled(struct wacom *wacom, int button_count,
 	if (wacom->wacom_wac.features.type == INTUOSP2_BT)
 		group_button = 8;
 
-	return mask & (1 << group_button);
+	return 1 << group_button;
+}
+
+static bool wacom_is_led_toggled(struct wacom *wacom, int button_count,
+				 int mask, int group)
+{
+	return mask & wacom_led_group_buttons(wacom, button_count, group);
 }
 
 static void wacom_update_led(struct wacom *wacom, int button_count, int mask,
@@ -4233,16 +4475,23 @@ static void wacom_update_led(struct wacom *wacom, int button_count, int mask,
 			  wacom_leds_brightness_get(next_led));
 }
 
-static void wacom_report_numbered_buttons(struct input_dev *input_dev,
-				int button_count, int mask)
+/*
+ * Report only the buttons whose state changed since the previous
+ * report. 'last' holds the previously reported mask and is updated
+ * in place.
+ */
+static void wacom_report_button_changes(struct input_dev *input_dev,
+				int button_count, int mask, u32 *last)
 {
-	struct wacom *wacom = input_get_drvdata(input_dev);
+	unsigned long changed = (u32)mask ^ *last;
 	int i;
 
-	for (i = 0; i < wacom->led.count; i++)
-		wacom_update_led(wacom,  button_count, mask, i);
+	if (!changed)
+		return;
 
-	for (i = 0; i < button_count; i++) {
+	*last = mask;
+
+	for_each_set_bit(i, &changed, button_count) {
 		int key = wacom_numbered_button_to_key(i);
 
 		if (key)
@@ -4250,6 +4499,26 @@ static void wacom_report_numbered_buttons(struct input_dev *input_dev,
 	}
 }
 
+/*
+ * LED groups are only updated when one of their toggle buttons changed
+ * state; see wacom_led_group_buttons().
+ */
+static void wacom_report_numbered_buttons(struct input_dev *input_dev,
+				int button_count, int mask)
+{
+	struct wacom *wacom = input_get_drvdata(input_dev);
+	int changed = mask ^ wacom->wacom_wac.pad_buttons;
+	int i;
+
+	for (i = 0; i < wacom->led.count; i++) {
+		if (changed & wacom_led_group_buttons(wacom, button_count, i))
+			wacom_update_led(wacom,  button_count, mask, i);
+	}
+
+	wacom_report_button_changes(input_dev, button_count, mask,
+				    &wacom->wacom_wac.pad_buttons);
+}
+
 int wacom_setup_pad_input_capabilities(struct input_dev *input_dev,
 				   struct wacom_wac *wacom_wac)
 {
@@ -4971,6 +5240,33 @@ static const struct wacom_features wacom_features_0x3dd =
 static const struct wacom_features wacom_features_HID_ANY_ID =
 	{ "Wacom HID", .type = HID_GENERIC, .oVid = HID_ANY_ID, .oPid = HID_ANY_ID };
 
+/*
+ * Generic devices whose touch rings are counter-clockwise-increasing
+ * and have their zero point somewhere other than the top.
+ */
+#define WACOM_GENERIC_RING_ROTATED(num, den)				\
+	{ "Wacom HID", .type = HID_GENERIC, .oVid = HID_ANY_ID, .oPid = HID_ANY_ID, \
+	  .ring_invert = true, .ring_rotation_num = num, .ring_rotation_den = den }
+
+/* MobileStudio Pro */
+static const struct wacom_features wacom_features_0x34D =
+	WACOM_GENERIC_RING_ROTATED(1, 2);
+static const struct wacom_features wacom_features_0x34E =
+	WACOM_GENERIC_RING_ROTATED(1, 2);
+static const struct wacom_features wacom_features_0x398 =
+	WACOM_GENERIC_RING_ROTATED(1, 2);
+static const struct wacom_features wacom_features_0x399 =
+	WACOM_GENERIC_RING_ROTATED(1, 2);
+static const struct wacom_features wacom_features_0x3AA =
+	WACOM_GENERIC_RING_ROTATED(1, 2);
+/* Intuos Pro 2 */
+static const struct wacom_features wacom_features_0x357 =
+	WACOM_GENERIC_RING_ROTATED(3, 16);
+static const struct wacom_features wacom_features_0x358 =
+	WACOM_GENERIC_RING_ROTATED(3, 16);
+static const struct wacom_features wacom_features_0x392 =
+	WACOM_GENERIC_RING_ROTATED(3, 16);
+
 static const struct wacom_features wacom_features_0x94 =
 	{ "Wacom Bootloader", .type = BOOTLOADER };
 
@@ -5141,13 +5437,21 @@ const struct hid_device_id wacom_ids[] = {
 	{ USB_DEVICE_WACOM(0x33D) },
 	{ USB_DEVICE_WACOM(0x33E) },
 	{ USB_DEVICE_WACOM(0x343) },
+	{ USB_DEVICE_WACOM(0x34D) },
+	{ USB_DEVICE_WACOM(0x34E) },
+	{ USB_DEVICE_WACOM(0x357) },
+	{ USB_DEVICE_WACOM(0x358) },
 	{ BT_DEVICE_WACOM(0x360) },
 	{ BT_DEVICE_WACOM(0x361) },
 	{ BT_DEVICE_WACOM(0x377) },
 	{ BT_DEVICE_WACOM(0x379) },
 	{ USB_DEVICE_WACOM(0x37A) },
 	{ USB_DEVICE_WACOM(0x37B) },
+	{ USB_DEVICE_WACOM(0x392) },
 	{ BT_DEVICE_WACOM(0x393) },
+	{ USB_DEVICE_WACOM(0x398) },
+	{ USB_DEVICE_WACOM(0x399) },
+	{ USB_DEVICE_WACOM(0x3AA) },
 	{ BT_DEVICE_WACOM(0x3c6) },
 	{ BT_DEVICE_WACOM(0x3c8) },
 	{ BT_DEVICE_WACOM(0x3dd) },
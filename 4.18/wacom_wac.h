@@ -6,6 +6,7 @@
 #include "../config.h"
 
 #include <linux/types.h>
+#include <linux/cache.h>
 #include <linux/hid.h>
 #include <linux/kfifo.h>
 #include <linux/version.h>
@@ -304,13 +305,38 @@ struct wacom_features {
 	unsigned int pktlen;
 	bool check_for_hid_type;
 	int hid_type;
+	bool ring_invert;
+	int ring_rotation_num;
+	int ring_rotation_den;
+};
+
+/*
+ * Per-usage value transform, resolved when the usage is mapped:
+ *   value = value * mul / div + add, wrapped once into [min, min + range)
+ * when range is non-zero. div is 1 unless a hi-res wheel's resolution
+ * multiplier doesn't divide 120.
+ */
+struct wacom_value_xform {
+	int mul;
+	int div;
+	int add;
+	int min;
+	int range;
+	__u16 lowres_code;	/* emulated low-res REL_* code, or 0 */
 };
 
 struct wacom_shared {
-	bool stylus_in_proximity;
-	bool touch_down;
+	/*
+	 * Pen/touch arbitration flags. Each is written from one sibling's
+	 * report path and read locklessly from the other's, possibly on
+	 * another CPU, so keep them on their own cache lines and only
+	 * access them with READ_ONCE()/WRITE_ONCE().
+	 */
+	bool stylus_in_proximity ____cacheline_aligned_in_smp;
+	bool touch_down ____cacheline_aligned_in_smp;
+
 	/* for wireless device to access USB interfaces */
-	unsigned touch_max;
+	unsigned touch_max ____cacheline_aligned_in_smp;
 	int type;
 	struct input_dev *touch_input;
 	struct hid_device *pen;
@@ -336,8 +362,7 @@ struct hid_data {
 	int width;
 	int height;
 	int id;
-	int ring_value;
-	int ring2_value;
+	int ring_value[2];
 	int cc_report;
 	int cc_index;
 	int cc_value_index;
@@ -363,36 +388,51 @@ struct wacom_remote_work_data {
 };
 
 struct wacom_wac {
-	char name[WACOM_NAME_MAX];
-	char pen_name[WACOM_NAME_MAX];
-	char touch_name[WACOM_NAME_MAX];
-	char pad_name[WACOM_NAME_MAX];
+	/*
+	 * Per-report working set: touched by every irq handler, keep it
+	 * packed at the start of the structure (see wacom_check_layout()).
+	 */
 	u8 *data;
+	struct wacom_shared *shared;
+	struct input_dev *pen_input;
+	struct input_dev *touch_input;
+	struct input_dev *pad_input;
 	int tool[2];
 	int id[2];
 	__u64 serial[2];
+	u32 pad_buttons;	/* last reported numbered-button mask */
 	bool probe_complete;
 	bool reporting_data;
+	bool is_invalid_bt_frame;
+	int num_contacts_left;
+	/*
+	 * Only the leading members (through numbered_buttons) are read per
+	 * report; the table initializers fix their order.
+	 */
 	struct wacom_features features;
-	struct wacom_shared *shared;
-	struct input_dev *pen_input;
-	struct input_dev *touch_input;
-	struct input_dev *pad_input;
+
+	/* Generic HID parser state, read per report by HID-described devices. */
+	struct hid_data hid_data;
+	struct wacom_value_xform ring_xform[4];
+	struct wacom_value_xform twist_xform;
+
+	/* Setup and management state, rarely touched once probed. */
 	struct kfifo_rec_ptr_2 *pen_fifo;
 	int pid;
-	int num_contacts_left;
 	u8 bt_features;
 	u8 bt_high_speed;
 	u8 absring_count;
 	u8 relring_count;
 	int mode_report;
 	int mode_value;
-	struct hid_data hid_data;
 	bool has_mute_touch_switch;
 	bool is_soft_touch_switch;
 	bool has_mode_change;
 	bool is_direct_mode;
-	bool is_invalid_bt_frame;
+	char name[WACOM_NAME_MAX];
+	char pen_name[WACOM_NAME_MAX];
+	char touch_name[WACOM_NAME_MAX];
+	char pad_name[WACOM_NAME_MAX];
 };
 
 #endif
@@ -38,16 +38,27 @@
  * Vojtech Pavlik, Simunkova 1594, Prague 8, 182 00 Czech Republic
  */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/serio.h>
 #include "serio-ids.h"
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 static int readchar(int fd, unsigned char *c, int timeout)
@@ -70,6 +81,26 @@ static int readchar(int fd, unsigned char *c, int timeout)
 	return 0;
 }
 
+/* write() all of @buf, retrying short writes; -1 on error */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
 static void setline(int fd, int flags, int speed)
 {
 	struct termios t;
@@ -360,6 +391,85 @@ static int fujitsu_init(int fd, unsigned long *id, unsigned long *extra)
 	return 0;
 }
 
+#define W8001_CMD_STOP		'0'
+#define W8001_CMD_START		'1'
+#define W8001_CMD_QUERY		'*'
+#define W8001_CMD_TOUCHQUERY	'%'
+#define W8001_PKTLEN_TPCCTL	11
+#define W8001_LEAD_MASK		0x80
+#define W8001_QUERY_MASK	0xd0	/* lead, tablet and touch bits */
+#define W8001_QUERY_BYTE	0xc0
+
+/*
+ * Send a W8001 query and check that a well formed reply comes back.
+ * The reply is stored in @reply, W8001_PKTLEN_TPCCTL bytes.
+ */
+static int w8001_query(int fd, unsigned char cmd, unsigned char *reply)
+{
+	int i;
+
+	if (write(fd, &cmd, 1) != 1)
+		return -1;
+
+	if (readchar(fd, &reply[0], 500) ||
+	    (reply[0] & W8001_QUERY_MASK) != W8001_QUERY_BYTE)
+		return -1;
+
+	for (i = 1; i < W8001_PKTLEN_TPCCTL; i++)
+		if (readchar(fd, &reply[i], 100) || (reply[i] & W8001_LEAD_MASK))
+			return -1;
+
+	return 0;
+}
+
+/* Check whether the tablet answers a pen or touch query at @speed */
+static int w8001_probe_speed(int fd, int speed)
+{
+	unsigned char reply[W8001_PKTLEN_TPCCTL];
+	unsigned char c;
+
+	setline(fd, CS8, speed);
+
+	c = W8001_CMD_STOP;
+	if (write(fd, &c, 1) != 1)
+		return -1;
+
+	/* wait for the tablet to stop and drop what it sent */
+	usleep(250 * 1000);
+	tcflush(fd, TCIFLUSH);
+
+	if (!w8001_query(fd, W8001_CMD_QUERY, reply) ||
+	    !w8001_query(fd, W8001_CMD_TOUCHQUERY, reply))
+		return 0;
+
+	return -1;
+}
+
+/*
+ * ISDv4 controllers run at 19200 baud or faster. Try the rate the line
+ * was set up with first (19200, or --baud), then the others, until the
+ * tablet answers a pen (or, on touch only models, touch) query.
+ */
+static int w8001_probe_init(int fd, unsigned long *id, unsigned long *extra)
+{
+	static const int speeds[] = { B19200, B38400, B57600, B115200 };
+	struct termios t;
+	int first = B19200;
+	unsigned int i;
+
+	if (!tcgetattr(fd, &t))
+		first = cfgetospeed(&t);
+
+	if (!w8001_probe_speed(fd, first))
+		return 0;
+
+	for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+		if (speeds[i] != first && !w8001_probe_speed(fd, speeds[i]))
+			return 0;
+
+	return -1;
+}
+
 static int dump_init(int fd, unsigned long *id, unsigned long *extra)
 {
 	unsigned char c, o = 0;
@@ -496,6 +606,9 @@ static struct input_types input_types[] = {
 { "--wacom",		"-wacom",	"Wacom W8001",
 	B19200, CS8,
 	SERIO_W8001,		0x00,	0x00,	0,	NULL },
+{ "--wacom-probe",	"-wacomp",	"Wacom W8001, probe the baud rate",
+	B19200, CS8,
+	SERIO_W8001,		0x00,	0x00,	0,	w8001_probe_init },
 { "--dump",		"-dump",	"Just enable device",
 	B2400, CS8,
 	0,			0x00,	0x00,	0,	dump_init },
@@ -508,6 +621,11 @@ static void show_help(void)
 
 	puts("");
 	puts("Usage: inputattach [--daemon] [--baud <baud>] <mode> <device>");
+	puts("       inputattach [--daemon] [--status <socket>] --config <file>");
+	puts("       inputattach [--baud <baud>] --capture <file> <mode> <device>");
+	puts("       inputattach --replay <file>");
+	puts("");
+	puts("The config file lists one '<device> <mode> [<baud>]' per line.");
 	puts("");
 	puts("Modes:");
 
@@ -521,20 +639,879 @@ static void show_help(void)
 /* palmed wisdom from http://stackoverflow.com/questions/1674162/ */
 #define RETRY_ERROR(x) (x == EAGAIN || x == EWOULDBLOCK || x == EINTR)
 
-int main(int argc, char **argv)
+static struct input_types *find_type(const char *name)
+{
+	struct input_types *type;
+
+	for (type = input_types; type->name; type++) {
+		if (!strcasecmp(name, type->name) ||
+		    !strcasecmp(name, type->name2))
+			return type;
+	}
+
+	return NULL;
+}
+
+/* Map a --baud value to its termios speed, -1 if unsupported */
+static int baud_to_speed(int baud)
+{
+	switch(baud) {
+	case 2400: return B2400;
+	case 4800: return B4800;
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	default: return -1;
+	}
+}
+
+/* Open @device and set up the line for @type */
+static int attach_open(const char *device, struct input_types *type, int speed)
+{
+	int fd;
+
+	fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0) {
+		fprintf(stderr, "inputattach: '%s' - %s\n",
+			device, strerror(errno));
+		return -1;
+	}
+
+	setline(fd, type->flags, speed);
+
+	return fd;
+}
+
+/* Flush and initialize the device; this may take several seconds */
+static int attach_init(int fd, struct input_types *type, unsigned long *id,
+		       unsigned long *extra, int no_init, int ignore_init_res)
+{
+	unsigned char c;
+
+	if (type->flush)
+		while (!readchar(fd, &c, 100))
+			/* empty */;
+
+	*id = type->id;
+	*extra = type->extra;
+
+	if (type->init && !no_init) {
+		if (type->init(fd, id, extra)) {
+			if (ignore_init_res) {
+				fprintf(stderr, "inputattach: ignored device initialization failure\n");
+			} else {
+				fprintf(stderr, "inputattach: device initialization failed\n");
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Hand the initialized device over to the serio line discipline */
+static int attach_ldisc(int fd, struct input_types *type, unsigned long id,
+			unsigned long extra)
 {
 	unsigned long devt;
 	int ldisc;
+
+	ldisc = N_MOUSE;
+	if (ioctl(fd, TIOCSETD, &ldisc) < 0) {
+		fprintf(stderr, "inputattach: can't set line discipline\n");
+		return -1;
+	}
+
+	devt = type->type | (id << 8) | (extra << 16);
+
+	if (ioctl(fd, SPIOCSTYPE, &devt) < 0) {
+		fprintf(stderr, "inputattach: can't set device type\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Open @device, initialize it and hand it over to the serio line
+ * discipline. Returns the open file descriptor, which has to stay open
+ * for as long as the device should remain attached, or -1.
+ */
+static int attach(const char *device, struct input_types *type, int speed,
+		  int no_init, int ignore_init_res)
+{
+	unsigned long id, extra;
+	int fd;
+
+	fd = attach_open(device, type, speed);
+	if (fd < 0)
+		return -1;
+
+	if (attach_init(fd, type, &id, &extra, no_init, ignore_init_res) ||
+	    attach_ldisc(fd, type, id, extra)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void detach(int fd)
+{
+	int ldisc = 0;
+
+	ioctl(fd, TIOCSETD, &ldisc);
+	close(fd);
+}
+
+/* Keep an attached device open until the serio port goes away */
+static void hold(int fd)
+{
+	int i;
+
+	do {
+		i = read(fd, NULL, 0);
+		if (i == -1) {
+			if (RETRY_ERROR(errno))
+				continue;
+		}
+	} while (!i);
+}
+
+#define SUPERVISE_MAX_DEVICES	64
+#define SUPERVISE_RETRY_MIN	1	/* seconds */
+#define SUPERVISE_RETRY_MAX	60
+
+/*
+ * The supervisor opens and attaches every port itself. Only the (possibly
+ * slow) initialization runs in a short-lived child, which works on the
+ * inherited port and sends a struct supervise_result down its pipe
+ * before exiting; end of file without one means the initialization
+ * failed.
+ */
+struct supervised {
+	char device[256];
+	struct input_types *type;
+	int speed;
+	int fd;			/* the open port, -1 if none */
+	pid_t pid;		/* init process, 0 if none */
+	int pipe_fd;		/* read end of its pipe */
+	unsigned int attaches;
+	unsigned int failures;
+	time_t retry_at;
+	int retry_delay;
+};
+
+struct supervise_result {
+	unsigned long id;
+	unsigned long extra;
+};
+
+static volatile sig_atomic_t quit;
+
+static void quit_signal(int sig)
+{
+	quit = 1;
+}
+
+static int supervise_load(const char *config, struct supervised *devs)
+{
+	char line[512], device[256], mode[64];
+	FILE *f;
+	int n = 0, lineno = 0;
+	int baud, fields;
+
+	f = fopen(config, "r");
+	if (!f) {
+		fprintf(stderr, "inputattach: '%s' - %s\n",
+			config, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		struct supervised *dev = &devs[n];
+
+		lineno++;
+		fields = sscanf(line, " %255s %63s %d", device, mode, &baud);
+		if (fields <= 0 || device[0] == '#')
+			continue;
+
+		if (n == SUPERVISE_MAX_DEVICES) {
+			fprintf(stderr, "inputattach: %s:%d: too many devices\n",
+				config, lineno);
+			goto fail;
+		}
+
+		memset(dev, 0, sizeof(*dev));
+		strcpy(dev->device, device);
+		dev->fd = -1;
+		dev->pipe_fd = -1;
+		dev->retry_delay = SUPERVISE_RETRY_MIN;
+
+		dev->type = fields >= 2 ? find_type(mode) : NULL;
+		/* dump_init never returns, it can't be supervised */
+		if (!dev->type || !dev->type->type) {
+			fprintf(stderr, "inputattach: %s:%d: invalid mode\n",
+				config, lineno);
+			goto fail;
+		}
+
+		dev->speed = fields == 3 ? baud_to_speed(baud) : dev->type->speed;
+		if (dev->speed < 0) {
+			fprintf(stderr, "inputattach: %s:%d: invalid baud rate '%d'\n",
+				config, lineno, baud);
+			goto fail;
+		}
+
+		n++;
+	}
+
+	fclose(f);
+	return n;
+
+fail:
+	fclose(f);
+	return -1;
+}
+
+static int supervise_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "inputattach: '%s' - path too long\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("inputattach");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 4) < 0) {
+		fprintf(stderr, "inputattach: '%s' - %s\n",
+			path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* One line per device: <device> <mode> <state> <attaches> <failures> */
+static void supervise_status(int listen_fd, struct supervised *devs, int n)
+{
+	char buf[SUPERVISE_MAX_DEVICES * 320];
+	size_t len = 0;
+	int fd, i;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < n; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%s %s %s %u %u\n",
+				devs[i].device, devs[i].type->name,
+				devs[i].pid ? "probing" :
+				devs[i].fd >= 0 ? "attached" : "waiting",
+				devs[i].attaches, devs[i].failures);
+
+	if (write_all(fd, buf, len) < 0)
+		fprintf(stderr, "inputattach: status - %s\n", strerror(errno));
+	close(fd);
+}
+
+static void supervise_retry(struct supervised *dev, time_t now)
+{
+	/* back off from a device that keeps failing to initialize */
+	dev->failures++;
+	dev->retry_at = now + dev->retry_delay;
+	if (dev->retry_delay < SUPERVISE_RETRY_MAX)
+		dev->retry_delay *= 2;
+}
+
+static void supervise_start(struct supervised *dev, int epfd, int no_init,
+			    int ignore_init_res)
+{
+	struct supervise_result res;
+	struct epoll_event ev;
+	int fds[2];
+	pid_t pid;
+
+	dev->fd = attach_open(dev->device, dev->type, dev->speed);
+	if (dev->fd < 0) {
+		supervise_retry(dev, time(NULL));
+		return;
+	}
+
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		perror("inputattach");
+		goto fail;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("inputattach");
+		close(fds[0]);
+		close(fds[1]);
+		goto fail;
+	}
+
+	if (!pid) {
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		close(fds[0]);
+
+		if (attach_init(dev->fd, dev->type, &res.id, &res.extra,
+				no_init, ignore_init_res) ||
+		    write_all(fds[1], &res, sizeof(res)) < 0)
+			_exit(EXIT_FAILURE);
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+	dev->pid = pid;
+	dev->pipe_fd = fds[0];
+
+	ev.events = EPOLLIN;
+	ev.data.fd = dev->pipe_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, dev->pipe_fd, &ev);
+	return;
+
+fail:
+	close(dev->fd);
+	dev->fd = -1;
+	supervise_retry(dev, time(NULL));
+}
+
+/* The init process of @dev reported in; attach the port if it succeeded */
+static void supervise_event(struct supervised *dev, int epfd)
+{
+	struct supervise_result res;
+	ssize_t ret;
+
+	ret = read(dev->pipe_fd, &res, sizeof(res));
+	if (ret < 0 && RETRY_ERROR(errno))
+		return;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, dev->pipe_fd, NULL);
+	close(dev->pipe_fd);
+	dev->pipe_fd = -1;
+	while (waitpid(dev->pid, NULL, 0) < 0 && errno == EINTR)
+		/* empty */;
+	dev->pid = 0;
+
+	if (ret != sizeof(res) ||
+	    attach_ldisc(dev->fd, dev->type, res.id, res.extra)) {
+		detach(dev->fd);
+		dev->fd = -1;
+		supervise_retry(dev, time(NULL));
+		return;
+	}
+
+	dev->attaches++;
+	dev->retry_delay = SUPERVISE_RETRY_MIN;
+}
+
+/*
+ * Once attached, the serio line discipline doesn't support poll, so a
+ * device that went away is noticed on the periodic check: the tty
+ * hangup leaves us with a file descriptor that fails every ioctl.
+ */
+static void supervise_check(struct supervised *dev, int epfd, int no_init,
+			    int ignore_init_res)
+{
+	int ldisc;
+
+	if (dev->pid)
+		return;
+
+	if (dev->fd >= 0) {
+		if (!ioctl(dev->fd, TIOCGETD, &ldisc) && ldisc == N_MOUSE)
+			return;
+
+		fprintf(stderr, "inputattach: '%s' - device went away\n",
+			dev->device);
+		detach(dev->fd);
+		dev->fd = -1;
+		dev->retry_at = time(NULL);
+	}
+
+	if (time(NULL) < dev->retry_at || access(dev->device, F_OK))
+		return;
+
+	supervise_start(dev, epfd, no_init, ignore_init_res);
+}
+
+static int supervise(const char *config, const char *status_path,
+		     int daemon_mode, int no_init, int ignore_init_res)
+{
+	static struct supervised devs[SUPERVISE_MAX_DEVICES];
+	struct itimerspec period = {
+		.it_interval = { .tv_sec = 1 },
+		.it_value = { .tv_nsec = 1 },
+	};
+	struct epoll_event ev, events[8];
+	struct sigaction sa;
+	char *status_abs = NULL;
+	int n, i, j, nev;
+	int epfd, timer_fd, status_fd = -1;
+	uint64_t ticks;
+
+	n = supervise_load(config, devs);
+	if (n < 0)
+		return EXIT_FAILURE;
+
+	if (status_path) {
+		status_fd = supervise_listen(status_path);
+		if (status_fd < 0)
+			return EXIT_FAILURE;
+
+		/* daemon() changes to /, remember where the socket is */
+		status_abs = realpath(status_path, NULL);
+		if (!status_abs) {
+			perror("inputattach");
+			return EXIT_FAILURE;
+		}
+	}
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (timer_fd < 0 || epfd < 0 ||
+	    timerfd_settime(timer_fd, 0, &period, NULL) < 0) {
+		perror("inputattach");
+		return EXIT_FAILURE;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = timer_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev);
+	if (status_fd >= 0) {
+		ev.data.fd = status_fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, status_fd, &ev);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = quit_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (daemon_mode && daemon(0, 0) < 0) {
+		perror("inputattach");
+		return EXIT_FAILURE;
+	}
+
+	while (!quit) {
+		nev = epoll_wait(epfd, events, 8, -1);
+		if (nev < 0) {
+			if (RETRY_ERROR(errno))
+				continue;
+			perror("inputattach");
+			break;
+		}
+
+		for (i = 0; i < nev; i++) {
+			if (events[i].data.fd == status_fd) {
+				supervise_status(status_fd, devs, n);
+				continue;
+			}
+
+			if (events[i].data.fd != timer_fd) {
+				for (j = 0; j < n; j++)
+					if (devs[j].pipe_fd == events[i].data.fd)
+						supervise_event(&devs[j], epfd);
+				continue;
+			}
+
+			if (read(timer_fd, &ticks, sizeof(ticks)) < 0)
+				continue;
+
+			for (j = 0; j < n && !quit; j++)
+				supervise_check(&devs[j], epfd, no_init,
+						ignore_init_res);
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		if (devs[i].pid)
+			kill(devs[i].pid, SIGTERM);
+	for (i = 0; i < n; i++) {
+		if (devs[i].pid)
+			waitpid(devs[i].pid, NULL, 0);
+		if (devs[i].fd >= 0)
+			detach(devs[i].fd);
+	}
+
+	if (status_fd >= 0) {
+		close(status_fd);
+		unlink(status_abs);
+		free(status_abs);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Capture files start with CAPTURE_MAGIC, followed by records of a
+ * CAPTURE_HEADER byte header and its data. The header holds, little
+ * endian and unpadded, the 8 byte time in ns, the 2 byte data length,
+ * the record type and the W8001 command byte. Stream records hold what
+ * the device sent, timed from the start of the capture; reply records
+ * hold a W8001 query reply, so a replay can answer the queries the
+ * kernel driver sends while probing.
+ */
+#define CAPTURE_MAGIC		"IACAP2\n"
+#define CAPTURE_HEADER		12
+#define CAPTURE_CHUNK		4096
+#define CAPTURE_STREAM		0
+#define CAPTURE_REPLY		1
+
+struct capture_record {
+	uint64_t ns;
+	uint16_t len;
+	uint8_t type;
+	uint8_t cmd;
+};
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int capture_write(FILE *f, uint64_t ns, int type, unsigned char cmd,
+			 const unsigned char *data, size_t len)
+{
+	unsigned char hdr[CAPTURE_HEADER];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		hdr[i] = ns >> (8 * i);
+	hdr[8] = len & 0xff;
+	hdr[9] = len >> 8;
+	hdr[10] = type;
+	hdr[11] = cmd;
+
+	if (fwrite(hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(data, 1, len, f) != len)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Record the W8001 replies to the pen and touch queries. A query that
+ * gets no well formed reply (e.g. the pen query on a touch only model)
+ * is left out.
+ */
+static int capture_w8001_replies(int fd, FILE *f)
+{
+	static const unsigned char cmds[] = {
+		W8001_CMD_QUERY, W8001_CMD_TOUCHQUERY
+	};
+	unsigned char reply[W8001_PKTLEN_TPCCTL], c;
+	unsigned int i;
+
+	c = W8001_CMD_STOP;
+	if (write_all(fd, &c, 1) < 0)
+		return -1;
+	usleep(250 * 1000);
+	tcflush(fd, TCIFLUSH);
+
+	for (i = 0; i < sizeof(cmds); i++) {
+		if (w8001_query(fd, cmds[i], reply)) {
+			tcflush(fd, TCIFLUSH);
+			continue;
+		}
+
+		if (capture_write(f, 0, CAPTURE_REPLY, cmds[i], reply,
+				  sizeof(reply)))
+			return -1;
+	}
+
+	c = W8001_CMD_START;
+	return write_all(fd, &c, 1);
+}
+
+static int capture(const char *path, const char *device,
+		   struct input_types *type, int speed)
+{
+	unsigned char buf[CAPTURE_CHUNK];
+	struct sigaction sa;
+	struct pollfd pfd;
+	uint64_t start;
+	ssize_t len;
+	FILE *f;
+	int fd;
+	int ret = EXIT_FAILURE;
+
+	fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0) {
+		fprintf(stderr, "inputattach: '%s' - %s\n",
+			device, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "inputattach: '%s' - %s\n",
+			path, strerror(errno));
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	setline(fd, type->flags, speed);
+
+	if (fputs(CAPTURE_MAGIC, f) == EOF ||
+	    (type->type == SERIO_W8001 && capture_w8001_replies(fd, f))) {
+		perror("inputattach");
+		goto out;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = quit_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	start = monotonic_ns();
+
+	/* read whatever has arrived in one go, stamped on arrival */
+	for (;;) {
+		if (quit) {
+			ret = EXIT_SUCCESS;
+			break;
+		}
+
+		if (poll(&pfd, 1, -1) < 0)
+			continue;
+
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (RETRY_ERROR(errno))
+				continue;
+			perror("inputattach");
+			break;
+		}
+		if (!len) {
+			ret = EXIT_SUCCESS;
+			break;
+		}
+
+		if (capture_write(f, monotonic_ns() - start, CAPTURE_STREAM,
+				  0, buf, len)) {
+			perror("inputattach");
+			break;
+		}
+	}
+
+out:
+	if (fclose(f) == EOF && ret == EXIT_SUCCESS) {
+		fprintf(stderr, "inputattach: '%s' - %s\n",
+			path, strerror(errno));
+		ret = EXIT_FAILURE;
+	}
+	close(fd);
+
+	return ret;
+}
+
+struct replay_reply {
+	unsigned char cmd;
+	unsigned char data[64];
+	size_t len;
+};
+
+static int replay_read(FILE *f, struct capture_record *rec,
+		       unsigned char *buf)
+{
+	unsigned char hdr[CAPTURE_HEADER];
+	int i;
+
+	if (fread(hdr, sizeof(hdr), 1, f) != 1)
+		return -1;
+
+	rec->ns = 0;
+	for (i = 7; i >= 0; i--)
+		rec->ns = rec->ns << 8 | hdr[i];
+	rec->len = hdr[8] | hdr[9] << 8;
+	rec->type = hdr[10];
+	rec->cmd = hdr[11];
+
+	if (rec->len > CAPTURE_CHUNK || fread(buf, 1, rec->len, f) != rec->len)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Answer the queries written to the pty; returns 1 once started, -1 if
+ * a reply can't be written.
+ */
+static int replay_commands(int master, struct replay_reply *replies,
+			   int nreplies)
+{
+	unsigned char cmds[64];
+	ssize_t len, i;
+	int j, started = 0;
+
+	len = read(master, cmds, sizeof(cmds));
+	for (i = 0; i < len; i++) {
+		if (cmds[i] == W8001_CMD_START)
+			started = 1;
+
+		for (j = 0; j < nreplies; j++)
+			if (replies[j].cmd == cmds[i] &&
+			    write_all(master, replies[j].data, replies[j].len))
+				return -1;
+	}
+
+	return started;
+}
+
+/*
+ * Replay a capture into a pseudo terminal at its original timing, so the
+ * serio driver can be exercised with "inputattach <mode> <pty>". When the
+ * capture holds query replies, the stream starts after the driver sends
+ * the W8001 start command; otherwise, as soon as the pty is opened.
+ */
+static int replay(const char *path)
+{
+	static struct replay_reply replies[4];
+	unsigned char buf[CAPTURE_CHUNK];
+	char magic[sizeof(CAPTURE_MAGIC)];
+	struct capture_record rec;
+	struct pollfd pfd;
+	struct timespec ts;
+	uint64_t start = 0, now;
+	int nreplies = 0;
+	int master, have;
+	int started, ret;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "inputattach: '%s' - %s\n",
+			path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (fread(magic, 1, strlen(CAPTURE_MAGIC), f) != strlen(CAPTURE_MAGIC) ||
+	    memcmp(magic, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC))) {
+		fprintf(stderr, "inputattach: '%s' - not a capture file\n", path);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		perror("inputattach");
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+
+	printf("%s\n", ptsname(master));
+	fflush(stdout);
+
+	/* collect the query replies, they precede the stream */
+	have = !replay_read(f, &rec, buf);
+	for (; have && rec.type == CAPTURE_REPLY;
+	     have = !replay_read(f, &rec, buf)) {
+		if (nreplies < (int)(sizeof(replies) / sizeof(replies[0])) &&
+		    rec.len <= sizeof(replies[0].data)) {
+			replies[nreplies].cmd = rec.cmd;
+			memcpy(replies[nreplies].data, buf, rec.len);
+			replies[nreplies].len = rec.len;
+			nreplies++;
+		}
+	}
+
+	pfd.fd = master;
+	pfd.events = POLLIN;
+
+	/* the master reports POLLHUP until someone opens the pty */
+	do {
+		usleep(100 * 1000);
+		poll(&pfd, 1, 0);
+	} while (pfd.revents & POLLHUP);
+
+	ret = EXIT_SUCCESS;
+	started = !nreplies;
+	while (have) {
+		if (started && !start)
+			start = monotonic_ns();
+
+		now = monotonic_ns();
+		if (started && now >= start + rec.ns) {
+			if (write_all(master, buf, rec.len))
+				goto fail;
+			have = !replay_read(f, &rec, buf);
+			continue;
+		}
+
+		if (started) {
+			ts.tv_sec = (start + rec.ns - now) / 1000000000ull;
+			ts.tv_nsec = (start + rec.ns - now) % 1000000000ull;
+		}
+
+		if (ppoll(&pfd, 1, started ? &ts : NULL, NULL) > 0) {
+			if (pfd.revents & POLLHUP)
+				break;
+			switch (replay_commands(master, replies, nreplies)) {
+			case -1:
+				goto fail;
+			case 1:
+				started = 1;
+			}
+		}
+	}
+
+	/* closing the master would hang up the reader, let it go first */
+	while (poll(&pfd, 1, -1) > 0 && !(pfd.revents & POLLHUP))
+		if (replay_commands(master, replies, nreplies) < 0)
+			goto fail;
+
+out:
+	fclose(f);
+	close(master);
+
+	return ret;
+
+fail:
+	perror("inputattach");
+	ret = EXIT_FAILURE;
+	goto out;
+}
+
+int main(int argc, char **argv)
+{
 	struct input_types *type = NULL;
 	const char *device = NULL;
+	const char *config = NULL;
+	const char *status_path = NULL;
+	const char *capture_path = NULL;
 	int daemon_mode = 0;
 	int need_device = 0;
-	unsigned long id, extra;
 	int fd;
 	int i;
-	unsigned char c;
 	int retval;
 	int baud = -1;
+	int speed;
 	int ignore_init_res = 0;
 	int no_init = 0;
 
@@ -560,6 +1537,33 @@ int main(int argc, char **argv)
 			}
 
 			baud = atoi(argv[++i]);
+		} else if (!strcasecmp(argv[i], "--replay")) {
+			if (argc <= i + 1) {
+				show_help();
+				fprintf(stderr,
+					"inputattach: '%s' requires a path\n",
+					argv[i]);
+				return EXIT_FAILURE;
+			}
+
+			return replay(argv[++i]);
+		} else if (!strcasecmp(argv[i], "--config") ||
+			   !strcasecmp(argv[i], "--status") ||
+			   !strcasecmp(argv[i], "--capture")) {
+			if (argc <= i + 1) {
+				show_help();
+				fprintf(stderr,
+					"inputattach: '%s' requires a path\n",
+					argv[i]);
+				return EXIT_FAILURE;
+			}
+
+			if (!strcasecmp(argv[i], "--config"))
+				config = argv[++i];
+			else if (!strcasecmp(argv[i], "--status"))
+				status_path = argv[++i];
+			else
+				capture_path = argv[++i];
 		} else {
 			if (type && type->name) {
 				fprintf(stderr,
@@ -567,13 +1571,8 @@ int main(int argc, char **argv)
 					"only one mode allowed\n", argv[i]);
 				return EXIT_FAILURE;
 			}
-			for (type = input_types; type->name; type++) {
-				if (!strcasecmp(argv[i], type->name) ||
-				    !strcasecmp(argv[i], type->name2)) {
-					break;
-				}
-			}
-			if (!type->name) {
+			type = find_type(argv[i]);
+			if (!type) {
 				fprintf(stderr,
 					"inputattach: invalid mode '%s'\n",
 					argv[i]);
@@ -583,6 +1582,15 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (config) {
+		if (type) {
+			fprintf(stderr, "inputattach: modes come from the config file\n");
+			return EXIT_FAILURE;
+		}
+		return supervise(config, status_path, daemon_mode,
+				 no_init, ignore_init_res);
+	}
+
 	if (!type || !type->name) {
 		fprintf(stderr, "inputattach: must specify mode\n");
 		return EXIT_FAILURE;
@@ -593,58 +1601,22 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
-	if (fd < 0) {
-		fprintf(stderr, "inputattach: '%s' - %s\n",
-			device, strerror(errno));
-		return 1;
-	}
-
-	switch(baud) {
-	case -1: break;
-	case 2400: type->speed = B2400; break;
-	case 4800: type->speed = B4800; break;
-	case 9600: type->speed = B9600; break;
-	case 19200: type->speed = B19200; break;
-	case 38400: type->speed = B38400; break;
-	default:
-		fprintf(stderr, "inputattach: invalid baud rate '%d'\n",
-				baud);
-		return EXIT_FAILURE;
-	}
-
-	setline(fd, type->flags, type->speed);
-
-	if (type->flush)
-		while (!readchar(fd, &c, 100))
-			/* empty */;
-
-	id = type->id;
-	extra = type->extra;
-
-	if (type->init && !no_init) {
-		if (type->init(fd, &id, &extra)) {
-			if (ignore_init_res) {
-				fprintf(stderr, "inputattach: ignored device initialization failure\n");
-			} else {
-				fprintf(stderr, "inputattach: device initialization failed\n");
-				return EXIT_FAILURE;
-			}
+	speed = type->speed;
+	if (baud != -1) {
+		speed = baud_to_speed(baud);
+		if (speed < 0) {
+			fprintf(stderr, "inputattach: invalid baud rate '%d'\n",
+					baud);
+			return EXIT_FAILURE;
 		}
 	}
 
-	ldisc = N_MOUSE;
-	if (ioctl(fd, TIOCSETD, &ldisc) < 0) {
-		fprintf(stderr, "inputattach: can't set line discipline\n");
-		return EXIT_FAILURE;
-	}
+	if (capture_path)
+		return capture(capture_path, device, type, speed);
 
-	devt = type->type | (id << 8) | (extra << 16);
-
-	if (ioctl(fd, SPIOCSTYPE, &devt) < 0) {
-		fprintf(stderr, "inputattach: can't set device type\n");
+	fd = attach(device, type, speed, no_init, ignore_init_res);
+	if (fd < 0)
 		return EXIT_FAILURE;
-	}
 
 	retval = EXIT_SUCCESS;
 	if (daemon_mode && daemon(0, 0) < 0) {
@@ -652,17 +1624,8 @@ int main(int argc, char **argv)
 		retval = EXIT_FAILURE;
 	}
 
-	do {
-		i = read(fd, NULL, 0);
-		if (i == -1) {
-			if (RETRY_ERROR(errno))
-				continue;
-		}
-	} while (!i);
-
-	ldisc = 0;
-	ioctl(fd, TIOCSETD, &ldisc);
-	close(fd);
+	hold(fd);
+	detach(fd);
 
 	return retval;
 }
@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+#
+# Capture an emulated W8001 tablet with inputattach --capture and play it
+# back with --replay, checking which query replies are kept and that
+# failures show in the exit status.
+#
+# Run from the top of the tree:  python3 inputattach/tests/test_capture_replay.py
+# Set INPUTATTACH to test an existing binary instead of building one.
+
+import os
+import select
+import signal
+import struct
+import subprocess
+import sys
+import tempfile
+import termios
+import time
+import tty
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from test_wacom_probe import REPLY, SOURCE, Tablet  # noqa: E402
+
+# pen samples: a lead byte with bit 7 set, then eight data bytes
+STREAM = bytes([0xa0, 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x00, 0x00]) * 4
+# a lead byte that doesn't have the query bits set
+BAD_REPLY = bytes([0x80]) + REPLY[1:]
+
+
+def read_for(fd, seconds, size=None):
+    data = b''
+    end = time.time() + seconds
+    while time.time() < end and (size is None or len(data) < size):
+        ready, _, _ = select.select([fd], [], [], 0.05)
+        if ready:
+            try:
+                data += os.read(fd, 256)
+            except OSError:
+                break
+    return data
+
+
+class CaptureReplayTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.TemporaryDirectory()
+        cls.binary = os.environ.get('INPUTATTACH')
+        if not cls.binary:
+            cls.binary = os.path.join(cls.tmpdir.name, 'inputattach')
+            subprocess.run([os.environ.get('CC', 'cc'), '-Wall', '-o',
+                            cls.binary, SOURCE], check=True)
+
+    def capture(self, path):
+        tablet = Tablet(termios.B19200, {ord('*'): REPLY, ord('%'): BAD_REPLY})
+        tablet.start()
+        proc = subprocess.Popen([self.binary, '--capture', path,
+                                 '--wacom', tablet.path],
+                                stderr=subprocess.PIPE, text=True)
+        # stop, two queries with their timeouts, then start
+        time.sleep(1.5)
+        tablet.send(STREAM)
+        time.sleep(0.3)
+        proc.send_signal(signal.SIGTERM)
+        _, err = proc.communicate(timeout=5)
+        tablet.close()
+        return proc.returncode, err
+
+    def test_capture_and_replay(self):
+        path = os.path.join(self.tmpdir.name, 'w8001.cap')
+        status, err = self.capture(path)
+        self.assertEqual(status, 0, err)
+
+        # records are a packed little endian <ns, len, type, cmd> header
+        with open(path, 'rb') as f:
+            data = f.read()
+        self.assertTrue(data.startswith(b'IACAP2\n'))
+        ns, length, kind, cmd = struct.unpack_from('<QHBB', data, 7)
+        self.assertEqual((ns, kind, cmd), (0, 1, ord('*')))
+        self.assertEqual(data[19:19 + length], REPLY)
+
+        proc = subprocess.Popen([self.binary, '--replay', path],
+                                stdout=subprocess.PIPE, text=True)
+        pts = proc.stdout.readline().strip()
+        fd = os.open(pts, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(fd)
+
+        os.write(fd, b'*')
+        self.assertEqual(read_for(fd, 0.5), REPLY)
+        # the malformed touch reply was not recorded
+        os.write(fd, b'%')
+        self.assertEqual(read_for(fd, 0.5), b'')
+
+        # the stream keeps its timing, about a second after the start
+        os.write(fd, b'1')
+        self.assertEqual(read_for(fd, 5.0, len(STREAM)), STREAM)
+
+        os.close(fd)
+        self.assertEqual(proc.wait(timeout=5), 0)
+        proc.stdout.close()
+
+    @unittest.skipUnless(os.path.exists('/dev/full'), 'needs /dev/full')
+    def test_capture_write_error(self):
+        status, err = self.capture('/dev/full')
+        self.assertEqual(status, 1)
+        self.assertIn('No space left on device', err)
+
+
+if __name__ == '__main__':
+    unittest.main()
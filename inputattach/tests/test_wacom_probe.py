@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+#
+# Exercise inputattach --wacom-probe against an emulated ISDv4 tablet on
+# a pseudo terminal. The emulator only answers queries while the line is
+# set to the tablet's baud rate, so the test shows which rates were tried
+# and whether the probe settled on the right one.
+#
+# Run from the top of the tree:  python3 inputattach/tests/test_wacom_probe.py
+# Set INPUTATTACH to test an existing binary instead of building one.
+
+import os
+import pty
+import select
+import subprocess
+import sys
+import tempfile
+import termios
+import threading
+import time
+import unittest
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SOURCE = os.path.join(HERE, '..', 'inputattach.c')
+
+QUERY = (ord('*'), ord('%'))
+# lead byte with the query bits, then ten data bytes without the lead bit
+REPLY = bytes([0xc0, 0x00, 0x10, 0x20, 0x00, 0x40, 0x00, 0x3f, 0x00, 0x7f, 0x12])
+
+
+class Tablet(threading.Thread):
+    """Answer W8001 queries on a pty master at one baud rate only."""
+
+    def __init__(self, speed, replies=None):
+        super().__init__(daemon=True)
+        self.speed = speed
+        self.replies = replies or {cmd: REPLY for cmd in QUERY}
+        self.master, slave = pty.openpty()
+        self.path = os.ttyname(slave)
+        # keep the slave open so the line settings can be inspected
+        self.slave = slave
+        self.queried = []
+        self.answered = False
+        self.stop = False
+
+    def run(self):
+        while not self.stop:
+            ready, _, _ = select.select([self.master], [], [], 0.1)
+            if not ready:
+                continue
+            try:
+                data = os.read(self.master, 64)
+            except OSError:
+                return
+            for c in data:
+                if c not in QUERY:
+                    continue
+                speed = termios.tcgetattr(self.slave)[5]
+                self.queried.append(speed)
+                if self.speed is not None and speed == self.speed:
+                    os.write(self.master, self.replies.get(c, b''))
+                    self.answered = True
+
+    def send(self, data):
+        os.write(self.master, data)
+
+    def close(self):
+        self.stop = True
+        self.join()
+        os.close(self.master)
+        os.close(self.slave)
+
+
+class WacomProbeTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.binary = os.environ.get('INPUTATTACH')
+        if cls.binary:
+            return
+        cls.tmpdir = tempfile.TemporaryDirectory()
+        cls.binary = os.path.join(cls.tmpdir.name, 'inputattach')
+        subprocess.run([os.environ.get('CC', 'cc'), '-Wall', '-o',
+                        cls.binary, SOURCE], check=True)
+
+    def probe(self, tablet_speed, *args):
+        tablet = Tablet(tablet_speed)
+        tablet.start()
+        proc = subprocess.Popen([self.binary] + list(args) +
+                                ['--wacom-probe', tablet.path],
+                                stderr=subprocess.PIPE, text=True)
+        try:
+            _, err = proc.communicate(timeout=15)
+        except subprocess.TimeoutExpired:
+            # privileged enough to attach the serio line discipline
+            proc.kill()
+            _, err = proc.communicate()
+        tablet.close()
+        return tablet, err
+
+    def assertProbed(self, tablet, err):
+        self.assertTrue(tablet.answered, 'tablet was never queried at its rate')
+        self.assertNotIn('device initialization failed', err)
+
+    def test_default_rate(self):
+        tablet, err = self.probe(termios.B19200)
+        self.assertProbed(tablet, err)
+        self.assertEqual(tablet.queried[0], termios.B19200)
+
+    def test_fast_rate(self):
+        tablet, err = self.probe(termios.B115200)
+        self.assertProbed(tablet, err)
+        self.assertEqual(tablet.queried[-1], termios.B115200)
+        self.assertIn(termios.B38400, tablet.queried)
+
+    def test_baud_is_tried_first(self):
+        tablet, err = self.probe(termios.B57600, '--baud', '57600')
+        self.assertProbed(tablet, err)
+        self.assertEqual(set(tablet.queried), {termios.B57600})
+
+    def test_silent_tablet(self):
+        tablet, err = self.probe(None)
+        self.assertIn('device initialization failed', err)
+        self.assertEqual(set(tablet.queried),
+                         {termios.B19200, termios.B38400,
+                          termios.B57600, termios.B115200})
+
+
+if __name__ == '__main__':
+    unittest.main()
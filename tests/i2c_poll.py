@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+#
+# Check the polling rate and runtime PM of wacom_i2c against the fake
+# controller in wacom_i2c_fake.ko.
+#
+# Build the fake with
+#   make -C /lib/modules/$(uname -r)/build M=$PWD
+# from this directory, load wacom_i2c, then run this script: it loads
+# the fake, which registers a controller without an interrupt, and
+# checks that
+#  - the controller is put to sleep while nobody has the device open,
+#  - opening it wakes the controller and polls it about every 50 ms,
+#  - with the pen in proximity the period drops to about 5 ms and the
+#    reports reach evdev,
+#  - closing it stops the polling and lets the controller sleep again.
+#
+# Needs root, and nothing else (udev rules, libinput) holding the new
+# input device open.
+
+import argparse
+import glob
+import os
+import subprocess
+import sys
+import time
+
+from wacom_uhid import BTN_TOOL_PEN, EV_KEY, Evdev
+
+PARAMS = '/sys/module/wacom_i2c_fake/parameters'
+NAME = 'Wacom I2C Digitizer'
+AUTOSUSPEND = 2.0
+
+
+def param(name, value=None):
+    path = os.path.join(PARAMS, name)
+    if value is None:
+        with open(path) as f:
+            return f.read().strip()
+    with open(path, 'w') as f:
+        f.write(value)
+
+
+def reads():
+    return int(param('reads'))
+
+
+def client_sysfs(timeout=5):
+    end = time.time() + timeout
+    while time.time() < end:
+        for path in glob.glob('/sys/bus/i2c/devices/*-000a'):
+            if os.path.basename(os.path.realpath(
+                    os.path.join(path, 'driver'))) == 'wacom_i2c':
+                return path
+        time.sleep(0.1)
+    raise RuntimeError('fake controller not bound to wacom_i2c')
+
+
+def evdev_node(client):
+    for node in glob.glob(os.path.join(client, 'input', 'input*')):
+        with open(os.path.join(node, 'name')) as f:
+            if f.read().strip() != NAME:
+                continue
+        events = glob.glob(os.path.join(node, 'event*'))
+        if events:
+            return '/dev/input/' + os.path.basename(events[0])
+    raise RuntimeError('no input device for the fake controller')
+
+
+def runtime_status(client):
+    with open(os.path.join(client, 'power', 'runtime_status')) as f:
+        return f.read().strip()
+
+
+def expect(what, ok):
+    print('%-50s %s' % (what, 'ok' if ok else 'FAILED'))
+    return ok
+
+
+def rate(seconds):
+    start = reads()
+    time.sleep(seconds)
+    return (reads() - start) / seconds
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--module', default=os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), 'wacom_i2c_fake.ko'))
+    args = parser.parse_args()
+
+    subprocess.run(['insmod', args.module], check=True)
+    ok = True
+    try:
+        client = client_sysfs()
+        time.sleep(AUTOSUSPEND + 0.5)
+        ok &= expect('controller asleep before open',
+                     runtime_status(client) == 'suspended' and
+                     int(param('power_sleep')) >= 1)
+
+        idle = rate(0.5)
+        ok &= expect('no polling before open (%.0f/s)' % idle, idle == 0)
+
+        reader = Evdev(evdev_node(client))
+        ok &= expect('controller woken on open',
+                     runtime_status(client) == 'active' and
+                     int(param('power_on')) >= 1)
+
+        slow = rate(2)
+        ok &= expect('idle poll rate %.0f/s, expected ~20' % slow,
+                     15 <= slow <= 22)
+
+        param('prox', '1')
+        time.sleep(0.1)
+        fast = rate(2)
+        ok &= expect('in-prox poll rate %.0f/s, expected ~200' % fast,
+                     150 <= fast <= 210)
+        param('prox', '0')
+
+        frames = reader.close()
+        pen = [f for _, f in frames if (EV_KEY, BTN_TOOL_PEN, 1) in f]
+        ok &= expect('pen reports reached evdev', bool(pen))
+
+        stopped = rate(0.5)
+        ok &= expect('polling stopped on close (%.0f/s)' % stopped,
+                     stopped == 0)
+        time.sleep(AUTOSUSPEND + 0.5)
+        ok &= expect('controller asleep after close',
+                     runtime_status(client) == 'suspended')
+        ok &= expect('no reads while asleep',
+                     int(param('reads_asleep')) == 0)
+    finally:
+        param('prox', '0')
+        subprocess.run(['rmmod', 'wacom_i2c_fake'], check=True)
+
+    if not ok:
+        sys.exit('FAIL')
+    print('PASS')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+#
+# Compare the two ways of loading the Intuos4 OLED button images.
+#
+# Creates an Intuos4 6x9 over uhid that acknowledges every feature
+# report after --delay milliseconds, standing in for the USB control
+# transfer, then loads all eight images through button0..7_rawimg and
+# through a single wacom_led_rawimg write, and finally changes one
+# image through wacom_led_rawimg. For each it prints how long the
+# writer was blocked, how long until the images reached the tablet and
+# how many feature reports were sent, and checks the tablet received
+# exactly the images that were written.
+#
+# Needs root, /dev/uhid and the wacom module loaded.
+
+import argparse
+import os
+import select
+import sys
+import time
+
+from wacom_uhid import UHidDevice
+
+PRODUCT = 0xb9                     # Intuos4 6x9
+IMAGE_SIZE = 1024                  # USB image format
+BUTTONS = 8
+WAC_CMD_ICON_START = 0x21
+WAC_CMD_ICON_XFER = 0x23
+
+# The driver handles Intuos4 reports itself, so a vendor-defined
+# collection with the pen report id is all the HID core needs to bind.
+RDESC = bytes([
+    0x06, 0x00, 0xff,              # Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x01,                    # Usage (0x01)
+    0xa1, 0x01,                    # Collection (Application)
+    0x85, 0x02,                    #  Report ID (2)
+    0x09, 0x01,                    #  Usage (0x01)
+    0x15, 0x00,                    #  Logical Minimum (0)
+    0x26, 0xff, 0x00,              #  Logical Maximum (255)
+    0x75, 0x08,                    #  Report Size (8)
+    0x95, 0x09,                    #  Report Count (9)
+    0x81, 0x02,                    #  Input (Data,Var,Abs)
+    0xc0,                          # End Collection
+])
+
+
+def images_sent(reports):
+    """Rebuild the button images from the feature reports the tablet got."""
+    images = {}
+    for _, rnum, data in reports:
+        if rnum != WAC_CMD_ICON_XFER:
+            continue
+        button, chunk = data[1], data[2]
+        image = images.setdefault(button, bytearray(IMAGE_SIZE))
+        size = IMAGE_SIZE // 4
+        image[chunk * size:(chunk + 1) * size] = data[3:3 + size]
+    return {b: bytes(i) for b, i in images.items()}
+
+
+def write_all(fd, data):
+    # sysfs hands binary attributes at most a page per write()
+    while data:
+        data = data[os.write(fd, data):]
+
+
+def per_button(leds, frame):
+    start = time.monotonic()
+    for i in range(BUTTONS):
+        fd = os.open(os.path.join(leds, 'button%d_rawimg' % i), os.O_WRONLY)
+        try:
+            os.write(fd, frame[i * IMAGE_SIZE:(i + 1) * IMAGE_SIZE])
+        finally:
+            os.close(fd)
+    end = time.monotonic() - start
+    return end, end
+
+
+def whole_frame(leds, frame, timeout=10):
+    # open before writing, so the notification at the end of the
+    # upload cannot be missed however early it comes
+    fd = os.open(os.path.join(leds, 'wacom_led_rawimg'), os.O_RDWR)
+    try:
+        poll = select.poll()
+        poll.register(fd, select.POLLPRI | select.POLLERR)
+        start = time.monotonic()
+        write_all(fd, frame)
+        blocked = time.monotonic() - start
+        if not poll.poll(timeout * 1000):
+            raise RuntimeError('no completion notification')
+        return blocked, time.monotonic() - start
+    finally:
+        os.close(fd)
+
+
+def run(tablet, label, load, leds, frame):
+    first = len(tablet.set_reports)
+    blocked, done = load(leds, frame)
+    reports = tablet.set_reports[first:]
+    print('%-28s blocked %7.1f ms, done %7.1f ms, %3d feature reports' %
+          (label, blocked * 1e3, done * 1e3, len(reports)))
+    return images_sent(reports)
+
+
+def check(label, sent, frame, buttons):
+    for i in buttons:
+        if sent.get(i) != frame[i * IMAGE_SIZE:(i + 1) * IMAGE_SIZE]:
+            sys.exit('FAIL: %s: button %d image differs' % (label, i))
+    extra = set(sent) - set(buttons)
+    if extra:
+        sys.exit('FAIL: %s: unchanged buttons %s were resent' %
+                 (label, sorted(extra)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--delay', type=float, default=1.0,
+                        help='milliseconds per feature report')
+    args = parser.parse_args()
+
+    tablet = UHidDevice('Wacom Intuos4 6x9', PRODUCT, RDESC,
+                        phys='uhid-oled/input0', set_delay=args.delay / 1e3)
+    try:
+        leds = os.path.join(tablet.sysfs(), 'wacom_led')
+
+        frame = os.urandom(BUTTONS * IMAGE_SIZE)
+        sent = run(tablet, 'button0..7_rawimg', per_button, leds, frame)
+        check('button0..7_rawimg', sent, frame, range(BUTTONS))
+
+        frame = os.urandom(BUTTONS * IMAGE_SIZE)
+        sent = run(tablet, 'wacom_led_rawimg', whole_frame, leds, frame)
+        check('wacom_led_rawimg', sent, frame, range(BUTTONS))
+
+        changed = bytearray(frame)
+        changed[3 * IMAGE_SIZE:4 * IMAGE_SIZE] = os.urandom(IMAGE_SIZE)
+        frame = bytes(changed)
+        sent = run(tablet, 'wacom_led_rawimg, 1 changed', whole_frame,
+                   leds, frame)
+        check('wacom_led_rawimg, 1 changed', sent, frame, [3])
+    finally:
+        tablet.destroy()
+
+    print('PASS')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,273 @@
+#!/usr/bin/env python3
+#
+# Race ExpressKey Remote reports against pairing changes.
+#
+# The driver only binds the remote receiver (056a:0331) when it sits on
+# a real USB interface: its features set check_for_hid_type with
+# HID_TYPE_USBNONE, a type only usbhid assigns, so a uhid device is
+# rejected with -ENODEV. This script therefore builds the receiver as a
+# USB gadget with the hid function and plugs it into dummy_hcd, which
+# puts usbhid and the driver's real USB path under test.
+#
+# For --seconds it sends device list reports that pair and unpair
+# random sets of remotes from one thread while other threads send
+# remote reports for paired and unpaired serials through the same
+# gadget. It then pairs five remotes, checks each one reports its own
+# button presses on its own input device, and fails if the kernel log
+# gained a warning, oops or lockdep/RCU splat during the run.
+#
+# Needs root, configfs, and the libcomposite, usb_f_hid, dummy_hcd and
+# wacom modules loaded.
+
+import argparse
+import glob
+import os
+import random
+import re
+import sys
+import threading
+import time
+
+from wacom_uhid import EV_KEY, Evdev
+
+GADGET = '/sys/kernel/config/usb_gadget/wacom_remote'
+PRODUCT = 0x0331
+REPORT_LEN = 32
+WACOM_REPORT_DEVICE_LIST = 0x10
+WACOM_REPORT_REMOTE = 0x11
+MAX_REMOTES = 5
+BTN_0 = 0x100
+EV_MSC = 0x04
+MSC_SERIAL = 0x00
+
+RDESC = bytes([
+    0x06, 0x00, 0xff,              # Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x01,                    # Usage (0x01)
+    0xa1, 0x01,                    # Collection (Application)
+    0x15, 0x00,                    #  Logical Minimum (0)
+    0x26, 0xff, 0x00,              #  Logical Maximum (255)
+    0x75, 0x08,                    #  Report Size (8)
+    0x95, REPORT_LEN - 1,          #  Report Count (31)
+    0x85, WACOM_REPORT_DEVICE_LIST,  # Report ID (16)
+    0x09, 0x01,                    #  Usage (0x01)
+    0x81, 0x02,                    #  Input (Data,Var,Abs)
+    0x85, WACOM_REPORT_REMOTE,     #  Report ID (17)
+    0x09, 0x01,                    #  Usage (0x01)
+    0x81, 0x02,                    #  Input (Data,Var,Abs)
+    0xc0,                          # End Collection
+])
+
+SPLAT = re.compile(r'WARNING:|BUG:|Oops|suspicious RCU usage|'
+                   r'possible circular locking|refcount_t|use-after-free')
+
+
+def put(path, value):
+    with open(os.path.join(GADGET, path), 'wb' if
+              isinstance(value, bytes) else 'w') as f:
+        f.write(value)
+
+
+def gadget_create():
+    os.makedirs(os.path.join(GADGET, 'strings/0x409'))
+    put('idVendor', '0x056a')
+    put('idProduct', '0x%04x' % PRODUCT)
+    put('strings/0x409/manufacturer', 'Wacom Co.,Ltd.')
+    put('strings/0x409/product', 'Wacom Express Key Remote')
+    put('strings/0x409/serialnumber', 'remote-stress')
+    os.makedirs(os.path.join(GADGET, 'functions/hid.usb0'))
+    put('functions/hid.usb0/protocol', '0')
+    put('functions/hid.usb0/subclass', '0')
+    put('functions/hid.usb0/report_length', str(REPORT_LEN))
+    put('functions/hid.usb0/report_desc', RDESC)
+    os.makedirs(os.path.join(GADGET, 'configs/c.1'))
+    os.symlink(os.path.join(GADGET, 'functions/hid.usb0'),
+               os.path.join(GADGET, 'configs/c.1/hid.usb0'))
+    udc = sorted(os.listdir('/sys/class/udc'))
+    udc = [u for u in udc if u.startswith('dummy_udc')]
+    if not udc:
+        raise RuntimeError('no dummy_udc; load dummy_hcd')
+    put('UDC', udc[0])
+
+    with open(os.path.join(GADGET, 'functions/hid.usb0/dev')) as f:
+        major, minor = map(int, f.read().split(':'))
+    for node in glob.glob('/dev/hidg*'):
+        if os.stat(node).st_rdev == os.makedev(major, minor):
+            return node
+    raise RuntimeError('no /dev/hidg node for %d:%d' % (major, minor))
+
+
+def gadget_remove():
+    if not os.path.isdir(GADGET):
+        return
+    try:
+        put('UDC', '\n')
+    except OSError:
+        pass
+    for path in ('configs/c.1/hid.usb0',):
+        if os.path.islink(os.path.join(GADGET, path)):
+            os.unlink(os.path.join(GADGET, path))
+    for path in ('configs/c.1', 'functions/hid.usb0', 'strings/0x409', ''):
+        os.rmdir(os.path.join(GADGET, path))
+
+
+def receiver_sysfs(timeout=10):
+    end = time.time() + timeout
+    while time.time() < end:
+        for path in glob.glob('/sys/bus/hid/devices/*:056A:%04X.*' %
+                              PRODUCT):
+            if os.path.basename(os.path.realpath(
+                    os.path.join(path, 'driver'))) == 'wacom':
+                return path
+        time.sleep(0.1)
+    raise RuntimeError('receiver not bound to the wacom driver')
+
+
+def device_list(serials):
+    data = bytearray(REPORT_LEN)
+    data[0] = WACOM_REPORT_DEVICE_LIST
+    for i, serial in enumerate(serials):
+        data[i * 6 + 4:i * 6 + 7] = serial.to_bytes(3, 'little')
+    return bytes(data)
+
+
+def remote_report(serial, buttons=0, wheel=0, battery=50):
+    data = bytearray(REPORT_LEN)
+    data[0] = WACOM_REPORT_REMOTE
+    data[3:6] = serial.to_bytes(3, 'little')
+    data[7] = battery
+    data[9:12] = buttons.to_bytes(3, 'little')
+    data[12] = wheel
+    return bytes(data)
+
+
+class Hidg:
+    """Serialises whole reports onto the gadget's IN endpoint."""
+
+    def __init__(self, node):
+        self.fd = os.open(node, os.O_RDWR)
+        self.lock = threading.Lock()
+
+    def send(self, data):
+        with self.lock:
+            os.write(self.fd, data)
+
+
+def churn(hidg, serials, stop, counts):
+    rng = random.Random(1)
+    n = 0
+    while not stop.is_set():
+        paired = rng.sample(serials, rng.randint(0, MAX_REMOTES))
+        hidg.send(device_list(paired + [0] * (MAX_REMOTES - len(paired))))
+        n += 1
+    counts['lists'] = n
+
+
+def press(hidg, serials, stop, counts, seed):
+    rng = random.Random(seed)
+    n = 0
+    while not stop.is_set():
+        hidg.send(remote_report(rng.choice(serials),
+                                rng.getrandbits(18),
+                                0x80 | rng.randint(1, 72)))
+        n += 1
+    counts['reports%d' % seed] = n
+
+
+def remote_inputs(hid, count, timeout=10):
+    """Map each paired serial to the event node of its input device."""
+    end = time.time() + timeout
+    while time.time() < end:
+        nodes = {}
+        for node in glob.glob(os.path.join(hid, 'input', 'input*')):
+            with open(os.path.join(node, 'uniq')) as f:
+                uniq = f.read().strip()
+            events = glob.glob(os.path.join(node, 'event*'))
+            if uniq.isdigit() and events:
+                nodes[int(uniq)] = '/dev/input/' + \
+                    os.path.basename(events[0])
+        if len(nodes) == count:
+            return nodes
+        time.sleep(0.1)
+    raise RuntimeError('expected %d remote inputs' % count)
+
+
+def check_routing(hidg, hid, serials):
+    hidg.send(device_list(serials))
+    nodes = remote_inputs(hid, len(serials))
+    readers = {s: Evdev(nodes[s]) for s in serials}
+    time.sleep(0.2)
+    for serial in serials:
+        hidg.send(remote_report(serial, buttons=1))
+        hidg.send(remote_report(serial))
+    for serial, reader in readers.items():
+        events = [e for _, frame in reader.close() for e in frame]
+        seen = {v & 0xffffff for k, c, v in events
+                if k == EV_MSC and c == MSC_SERIAL}
+        pressed = (EV_KEY, BTN_0, 1) in events
+        if seen != {serial} or not pressed:
+            sys.exit('FAIL: remote %d got serials %s, BTN_0 %s' %
+                     (serial, sorted(seen), pressed))
+
+
+def kmsg_open():
+    fd = os.open('/dev/kmsg', os.O_RDONLY | os.O_NONBLOCK)
+    os.lseek(fd, 0, os.SEEK_END)
+    return fd
+
+
+def kmsg_splats(fd):
+    lines = []
+    while True:
+        try:
+            lines.append(os.read(fd, 8192).decode(errors='replace'))
+        except BlockingIOError:
+            break
+        except OSError:
+            # records overwritten while we were reading
+            continue
+    return [l for l in lines if SPLAT.search(l)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--seconds', type=float, default=30)
+    parser.add_argument('--writers', type=int, default=3)
+    args = parser.parse_args()
+
+    serials = random.Random(0).sample(range(1, 1 << 24), MAX_REMOTES + 3)
+    kmsg = kmsg_open()
+    gadget_remove()
+    hidg = Hidg(gadget_create())
+    try:
+        hid = receiver_sysfs()
+
+        stop = threading.Event()
+        counts = {}
+        threads = [threading.Thread(target=churn,
+                                    args=(hidg, serials, stop, counts))]
+        threads += [threading.Thread(target=press,
+                                     args=(hidg, serials, stop, counts, i))
+                    for i in range(args.writers)]
+        for t in threads:
+            t.start()
+        time.sleep(args.seconds)
+        stop.set()
+        for t in threads:
+            t.join()
+        print('%d device lists, %d remote reports' %
+              (counts['lists'], sum(v for k, v in counts.items()
+                                    if k.startswith('reports'))))
+
+        check_routing(hidg, hid, serials[:MAX_REMOTES])
+    finally:
+        os.close(hidg.fd)
+        gadget_remove()
+
+    splats = kmsg_splats(kmsg)
+    if splats:
+        sys.exit('FAIL: kernel log:\n' + ''.join(splats))
+    print('PASS')
+
+
+if __name__ == '__main__':
+    main()
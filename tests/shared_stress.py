@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+#
+# Stress the pen/touch arbitration state shared between sibling
+# interfaces (struct wacom_shared).
+#
+# Creates a HID generic pen and touchscreen as two uhid interfaces of
+# the same tablet, so the driver pairs them, then feeds pen proximity
+# and touch contacts from two threads at once: first pinned to two
+# different CPUs, where the shared flags bounce between caches, then
+# both on one CPU as a baseline. For each run it prints how many
+# reports per second the driver handled and checks that no touch
+# contact was reported while the pen was in proximity, past the one
+# stale report the driver's lockless arbitration allows.
+#
+# Needs root, /dev/uhid, the wacom module loaded with
+# touch_arbitration=1 (the default) and at least two CPUs.
+
+import argparse
+import os
+import random
+import struct
+import sys
+import threading
+import time
+
+from wacom_uhid import (BTN_TOOL_PEN, BTN_TOUCH, EV_KEY, Evdev, UHidDevice,
+                        key_intervals)
+
+PRODUCT = 0x5000
+
+# The driver reads the pen's proximity flag without locking, so a touch
+# report racing with the pen entering proximity can still see the old
+# value; the next touch report is muted (see wacom_shared_pen_prox() in
+# wacom_wac.c). At most this many touch reports may therefore carry a
+# contact once the pen is in proximity.
+STALE_TOUCH_REPORTS = 1
+
+PEN_RDESC = bytes([
+    0x05, 0x0d,                    # Usage Page (Digitizers)
+    0x09, 0x02,                    # Usage (Pen)
+    0xa1, 0x01,                    # Collection (Application)
+    0x85, 0x02,                    #  Report ID (2)
+    0x09, 0x20,                    #  Usage (Stylus)
+    0xa1, 0x00,                    #  Collection (Physical)
+    0x09, 0x42,                    #   Usage (Tip Switch)
+    0x09, 0x32,                    #   Usage (In Range)
+    0x15, 0x00,                    #   Logical Minimum (0)
+    0x25, 0x01,                    #   Logical Maximum (1)
+    0x75, 0x01,                    #   Report Size (1)
+    0x95, 0x02,                    #   Report Count (2)
+    0x81, 0x02,                    #   Input (Data,Var,Abs)
+    0x95, 0x06,                    #   Report Count (6)
+    0x81, 0x03,                    #   Input (Cnst,Var,Abs)
+    0x05, 0x01,                    #   Usage Page (Generic Desktop)
+    0x09, 0x30,                    #   Usage (X)
+    0x09, 0x31,                    #   Usage (Y)
+    0x26, 0x10, 0x27,              #   Logical Maximum (10000)
+    0x75, 0x10,                    #   Report Size (16)
+    0x95, 0x02,                    #   Report Count (2)
+    0x81, 0x02,                    #   Input (Data,Var,Abs)
+    0x05, 0x0d,                    #   Usage Page (Digitizers)
+    0x09, 0x30,                    #   Usage (Tip Pressure)
+    0x26, 0xff, 0x03,              #   Logical Maximum (1023)
+    0x95, 0x01,                    #   Report Count (1)
+    0x81, 0x02,                    #   Input (Data,Var,Abs)
+    0xc0,                          #  End Collection
+    0xc0,                          # End Collection
+])
+
+TOUCH_RDESC = bytes([
+    0x05, 0x0d,                    # Usage Page (Digitizers)
+    0x09, 0x04,                    # Usage (Touch Screen)
+    0xa1, 0x01,                    # Collection (Application)
+    0x85, 0x03,                    #  Report ID (3)
+    0x09, 0x22,                    #  Usage (Finger)
+    0xa1, 0x02,                    #  Collection (Logical)
+    0x09, 0x42,                    #   Usage (Tip Switch)
+    0x15, 0x00,                    #   Logical Minimum (0)
+    0x25, 0x01,                    #   Logical Maximum (1)
+    0x75, 0x01,                    #   Report Size (1)
+    0x95, 0x01,                    #   Report Count (1)
+    0x81, 0x02,                    #   Input (Data,Var,Abs)
+    0x95, 0x07,                    #   Report Count (7)
+    0x81, 0x03,                    #   Input (Cnst,Var,Abs)
+    0x09, 0x51,                    #   Usage (Contact Identifier)
+    0x25, 0x0f,                    #   Logical Maximum (15)
+    0x75, 0x08,                    #   Report Size (8)
+    0x95, 0x01,                    #   Report Count (1)
+    0x81, 0x02,                    #   Input (Data,Var,Abs)
+    0x05, 0x01,                    #   Usage Page (Generic Desktop)
+    0x09, 0x30,                    #   Usage (X)
+    0x09, 0x31,                    #   Usage (Y)
+    0x26, 0x10, 0x27,              #   Logical Maximum (10000)
+    0x75, 0x10,                    #   Report Size (16)
+    0x95, 0x02,                    #   Report Count (2)
+    0x81, 0x02,                    #   Input (Data,Var,Abs)
+    0xc0,                          #  End Collection
+    0x05, 0x0d,                    #  Usage Page (Digitizers)
+    0x09, 0x54,                    #  Usage (Contact Count)
+    0x25, 0x0f,                    #  Logical Maximum (15)
+    0x75, 0x08,                    #  Report Size (8)
+    0x95, 0x01,                    #  Report Count (1)
+    0x81, 0x02,                    #  Input (Data,Var,Abs)
+    0x85, 0x04,                    #  Report ID (4)
+    0x09, 0x55,                    #  Usage (Contact Count Maximum)
+    0xb1, 0x02,                    #  Feature (Data,Var,Abs)
+    0xc0,                          # End Collection
+])
+
+
+def pen_report(prox, x, y):
+    return struct.pack('<BBHHH', 0x02, 0x03 if prox else 0, x, y,
+                       512 if prox else 0)
+
+
+def touch_report(down, x, y):
+    return struct.pack('<BBBHHB', 0x03, 1 if down else 0, 0, x, y, 1)
+
+
+def writer(dev, report, cpu, stop, counts, key):
+    """Toggle between 1..20 reports in contact and 1..20 out of it."""
+    os.sched_setaffinity(0, {cpu})
+    rng = random.Random(cpu * 31 + len(key))
+    n = 0
+    while not stop.is_set():
+        for state in (True, False):
+            for _ in range(rng.randint(1, 20)):
+                dev.input(report(state, rng.randint(0, 10000),
+                                 rng.randint(0, 10000)))
+                n += 1
+    dev.input(report(False, 0, 0))
+    counts[key] = n
+
+
+def touch_during_prox(pen, frames):
+    """For each pen proximity interval, the touch frames with a contact."""
+    down = False
+    contact = []
+    for t, frame in frames:
+        for kind, c, value in frame:
+            if kind == EV_KEY and c == BTN_TOUCH:
+                down = bool(value)
+        if down:
+            contact.append(t)
+
+    return [sum(1 for t in contact if ps <= t < pe) for ps, pe in pen]
+
+
+def run(pen, touch, pen_cpu, touch_cpu, seconds):
+    pen_ev = Evdev(pen.evdev(' Pen'))
+    touch_ev = Evdev(touch.evdev(' Finger'))
+    stop = threading.Event()
+    counts = {}
+    threads = [
+        threading.Thread(target=writer, args=(pen, pen_report, pen_cpu,
+                                              stop, counts, 'pen')),
+        threading.Thread(target=writer, args=(touch, touch_report,
+                                              touch_cpu, stop, counts,
+                                              'touch')),
+    ]
+    start = time.monotonic()
+    for t in threads:
+        t.start()
+    time.sleep(seconds)
+    stop.set()
+    for t in threads:
+        t.join()
+    elapsed = time.monotonic() - start
+
+    pen_prox = key_intervals(pen_ev.close(), BTN_TOOL_PEN)
+    stale = [n for n in touch_during_prox(pen_prox, touch_ev.close()) if n]
+    rate = (counts['pen'] + counts['touch']) / elapsed
+    print('cpus %d/%d: %8.0f reports/s, %d pen intervals, %d with touch '
+          'contacts%s' % (pen_cpu, touch_cpu, rate, len(pen_prox),
+                          len(stale), ' (at most %d reports)' % max(stale)
+                          if stale else ''))
+    return rate, stale
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--seconds', type=float, default=10)
+    parser.add_argument('--cpus', type=int, nargs=2, default=None,
+                        help='the two CPUs to pin the writers to')
+    args = parser.parse_args()
+
+    cpus = args.cpus or sorted(os.sched_getaffinity(0))[:2]
+    if len(set(cpus)) < 2:
+        sys.exit('need two CPUs')
+
+    name = 'Wacom Arbitration Test'
+    pen = UHidDevice(name, PRODUCT, PEN_RDESC, phys='uhid-stress/input0')
+    touch = UHidDevice(name, PRODUCT, TOUCH_RDESC,
+                       phys='uhid-stress/input1', features={4: b'\x04\x01'})
+    try:
+        cross, cross_bad = run(pen, touch, cpus[0], cpus[1], args.seconds)
+        same, same_bad = run(pen, touch, cpus[0], cpus[0], args.seconds)
+    finally:
+        touch.destroy()
+        pen.destroy()
+
+    print('cross-CPU throughput is %.0f%% of the single-CPU baseline' %
+          (100 * cross / same))
+    # anything past the stale read means the arbitration state was lost
+    if any(n > STALE_TOUCH_REPORTS for n in cross_bad + same_bad):
+        sys.exit('FAIL: touch reported during pen proximity')
+    print('PASS')
+
+
+if __name__ == '__main__':
+    main()
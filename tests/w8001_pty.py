@@ -0,0 +1,326 @@
+#!/usr/bin/env python3
+#
+# Feed a W8001 pen and two finger touch stream to wacom_w8001 and check
+# what comes out of evdev.
+#
+# The script plays the tablet: it answers the driver's pen and touch
+# queries, then sends pen strokes and touch gestures split into writes
+# of random size, with runs of stray bytes between packets, and checks
+# every pen position and touch frame arrives.
+#
+# By default the tablet sits on a pty and inputattach --wacom attaches
+# it, which tests the serio path. A pty cannot back a serdev device:
+# serdev controllers are registered by UART drivers for ports described
+# in DT or ACPI. To test the serdev block parser, give the UART that is
+# wired null-modem to the one with the "wacom,w8001" node as --peer,
+# and the serdev device name (e.g. serial0-0) as --serdev; in a VM two
+# 16550 ports joined by a host socket chardev will do. The script then
+# (re)binds the driver once the tablet is answering, also sends
+# truncated packets, and checks the resyncs counter in debugfs.
+#
+# Needs root and wacom_w8001 loaded; the pty mode builds inputattach
+# from ../inputattach unless --inputattach is given.
+
+import argparse
+import glob
+import os
+import pty
+import random
+import select
+import subprocess
+import sys
+import tempfile
+import termios
+import threading
+import time
+import tty
+
+from wacom_uhid import EV_ABS, Evdev
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+INPUTATTACH = os.path.join(HERE, '..', 'inputattach', 'inputattach.c')
+
+PEN_MAX = (20000, 12500, 1023)
+TOUCH_MAX = 4095
+ABS_X, ABS_Y = 0x00, 0x01
+
+SPEEDS = {19200: termios.B19200, 38400: termios.B38400,
+          57600: termios.B57600, 115200: termios.B115200}
+
+
+def pen_packet(x, y, pressure=0, rdy=True, tip=False, lead=0x80):
+    return bytes([
+        lead | (0x20 if rdy else 0) | (0x01 if tip else 0),
+        (x >> 9) & 0x7f, (x >> 2) & 0x7f,
+        (y >> 9) & 0x7f, (y >> 2) & 0x7f,
+        pressure & 0x7f,
+        ((x & 3) << 5) | ((y & 3) << 3) | ((pressure >> 7) & 7),
+        0, 0])
+
+
+# query replies carry the tablet bit in the lead byte
+PEN_QUERY = pen_packet(*PEN_MAX, rdy=False, lead=0xc0) + bytes(2)
+TOUCH_QUERY = bytes([
+    0xc0,
+    10,                                         # panel resolution
+    5 | ((TOUCH_MAX & 3) << 5) | ((TOUCH_MAX & 3) << 3),   # 2FG sensor
+    (TOUCH_MAX >> 9) & 0x7f, (TOUCH_MAX >> 2) & 0x7f,
+    (TOUCH_MAX >> 9) & 0x7f, (TOUCH_MAX >> 2) & 0x7f,
+    0, 0, 0, 0])
+
+
+def touch_packet(fingers):
+    """Two finger packet; @fingers holds (x, y) or None per finger."""
+    data = bytearray(13)
+    data[0] = 0x90
+    for i, pos in enumerate(fingers):
+        if pos is None:
+            continue
+        data[0] |= 1 << i
+        x, y = pos
+        data[6 * i + 1:6 * i + 5] = bytes([x >> 7, x & 0x7f,
+                                           y >> 7, y & 0x7f])
+    return bytes(data)
+
+
+def session(rng, strokes):
+    """Packets of alternating pen strokes and touch gestures.
+
+    Every packet moves what it reports, so each one shows up as its own
+    evdev frame; returns (packet, kind, position) tuples.
+    """
+    packets = []
+    i = 0
+    for _ in range(strokes):
+        for n in range(rng.randint(5, 40)):
+            i += 1
+            x = 100 + (i * 37) % (PEN_MAX[0] - 200)
+            y = 100 + (i * 53) % (PEN_MAX[1] - 200)
+            packets.append((pen_packet(x, y, rng.randint(0, 1023),
+                                       tip=n > 2), 'pen', (x, y)))
+        i += 1
+        x = 100 + (i * 37) % (PEN_MAX[0] - 200)
+        y = 100 + (i * 53) % (PEN_MAX[1] - 200)
+        packets.append((pen_packet(x, y, rdy=False), 'pen', (x, y)))
+
+        for _ in range(rng.randint(5, 40)):
+            i += 1
+            first = (100 + (i * 41) % 3800, 100 + (i * 43) % 3800)
+            second = (first[0] + 50, first[1] + 50) \
+                if rng.random() < 0.5 else None
+            packets.append((touch_packet([first, second]), 'touch', first))
+        packets.append((touch_packet([None, None]), 'touch', None))
+    return packets
+
+
+class Tablet(threading.Thread):
+    """Answer the driver's queries on @fd and stream packets to it."""
+
+    def __init__(self, fd):
+        super().__init__(daemon=True)
+        self.fd = fd
+        self.lock = threading.Lock()
+        self.stop = False
+
+    def run(self):
+        while not self.stop:
+            ready, _, _ = select.select([self.fd], [], [], 0.1)
+            if not ready:
+                continue
+            try:
+                data = os.read(self.fd, 64)
+            except OSError:
+                return
+            for c in data:
+                if c == ord('*'):
+                    self.write(PEN_QUERY)
+                elif c == ord('%'):
+                    self.write(TOUCH_QUERY)
+
+    def write(self, data):
+        with self.lock:
+            while data:
+                data = data[os.write(self.fd, data):]
+
+    def close(self):
+        self.stop = True
+        self.join()
+
+
+def stream(tablet, rng, packets, truncate):
+    """Send @packets in random chunks; returns those that stay whole."""
+    out = bytearray()
+    kept = []
+    faults = 0
+    for packet, kind, pos in packets:
+        if rng.random() < 0.05:
+            out += bytes(rng.randrange(0x80) for _ in range(rng.randint(1, 5)))
+            faults += 1
+        if truncate and rng.random() < 0.02:
+            out += packet[:rng.randint(1, len(packet) - 1)]
+            faults += 1
+        out += packet
+        kept.append((kind, pos))
+
+    while out:
+        n = rng.randint(1, 64)
+        tablet.write(bytes(out[:n]))
+        del out[:n]
+        if rng.random() < 0.1:
+            time.sleep(rng.random() * 0.002)
+    return kept, faults
+
+
+def input_devices():
+    return set(glob.glob('/sys/class/input/input*'))
+
+
+def new_event_nodes(before, timeout=10):
+    """Event nodes of the pen and touch devices that appeared since @before."""
+    end = time.time() + timeout
+    while time.time() < end:
+        nodes = {}
+        for path in input_devices() - before:
+            with open(os.path.join(path, 'name')) as f:
+                name = f.read().strip()
+            events = glob.glob(os.path.join(path, 'event*'))
+            if not name.startswith('Wacom Serial') or not events:
+                continue
+            kind = 'pen' if name.endswith(' Pen') else 'touch'
+            nodes[kind] = '/dev/input/' + os.path.basename(events[0])
+        if len(nodes) == 2:
+            return nodes
+        time.sleep(0.1)
+    raise RuntimeError('wacom_w8001 did not create pen and touch devices')
+
+
+def pen_positions(frames):
+    pos = [None, None]
+    out = []
+    for _, frame in frames:
+        moved = False
+        for kind, code, value in frame:
+            if kind == EV_ABS and code in (ABS_X, ABS_Y):
+                pos[code] = value
+                moved = True
+        if moved:
+            out.append(tuple(pos))
+    return out
+
+
+def check(readers, kept, settle=1.0):
+    # wait for the last frames to come through
+    time.sleep(settle)
+    pen = pen_positions(readers['pen'].close())
+    touch = readers['touch'].close()
+    want_pen = [pos for kind, pos in kept if kind == 'pen']
+    want_touch = sum(1 for kind, _ in kept if kind == 'touch')
+
+    ok = True
+    if pen != want_pen:
+        bad = next((i for i, (a, b) in enumerate(zip(pen, want_pen))
+                    if a != b), min(len(pen), len(want_pen)))
+        print('pen: %d positions, expected %d; first difference at %d' %
+              (len(pen), len(want_pen), bad))
+        ok = False
+    if len(touch) != want_touch:
+        print('touch: %d frames, expected %d' % (len(touch), want_touch))
+        ok = False
+    return ok
+
+
+def build_inputattach(tmpdir):
+    binary = os.path.join(tmpdir, 'inputattach')
+    subprocess.run([os.environ.get('CC', 'cc'), '-Wall', '-o', binary,
+                    INPUTATTACH], check=True)
+    return binary
+
+
+def run_pty(args, rng, packets):
+    with tempfile.TemporaryDirectory() as tmpdir:
+        binary = args.inputattach or build_inputattach(tmpdir)
+        master, slave = pty.openpty()
+        tablet = Tablet(master)
+        tablet.start()
+        before = input_devices()
+        proc = subprocess.Popen([binary, '--wacom', os.ttyname(slave)])
+        try:
+            nodes = new_event_nodes(before)
+            readers = {k: Evdev(v) for k, v in nodes.items()}
+            kept, faults = stream(tablet, rng, packets, truncate=False)
+            print('serio: %d packets, %d noise runs' % (len(kept), faults))
+            return check(readers, kept)
+        finally:
+            proc.terminate()
+            proc.wait()
+            tablet.close()
+            os.close(master)
+            os.close(slave)
+
+
+def resyncs(name):
+    with open('/sys/kernel/debug/w8001/%s/resyncs' % name) as f:
+        return int(f.read())
+
+
+def run_peer(args, rng, packets):
+    fd = os.open(args.peer, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    attrs = termios.tcgetattr(fd)
+    attrs[4] = attrs[5] = SPEEDS[args.baud]
+    termios.tcsetattr(fd, termios.TCSANOW, attrs)
+
+    tablet = Tablet(fd)
+    tablet.start()
+    try:
+        drv = '/sys/bus/serial/drivers/w8001'
+        if os.path.exists(os.path.join(drv, args.serdev)):
+            with open(os.path.join(drv, 'unbind'), 'w') as f:
+                f.write(args.serdev)
+        before = input_devices()
+        with open(os.path.join(drv, 'bind'), 'w') as f:
+            f.write(args.serdev)
+
+        nodes = new_event_nodes(before)
+        readers = {k: Evdev(v) for k, v in nodes.items()}
+        start = resyncs(args.serdev)
+        kept, faults = stream(tablet, rng, packets, truncate=True)
+        # the UART drains at line rate
+        ok = check(readers, kept, settle=2 + len(packets) * 13 * 10 /
+                   args.baud)
+        seen = resyncs(args.serdev) - start
+        print('serdev: %d packets, %d faults injected, %d resyncs' %
+              (len(kept), faults, seen))
+        if seen < faults:
+            print('resyncs: expected at least %d' % faults)
+            ok = False
+        return ok
+    finally:
+        tablet.close()
+        os.close(fd)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--strokes', type=int, default=50)
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--inputattach', help='inputattach binary to use')
+    parser.add_argument('--peer', help='tty wired to the serdev UART')
+    parser.add_argument('--serdev', help='serdev device to bind')
+    parser.add_argument('--baud', type=int, default=19200,
+                        choices=sorted(SPEEDS))
+    args = parser.parse_args()
+    if bool(args.peer) != bool(args.serdev):
+        parser.error('--peer and --serdev go together')
+
+    rng = random.Random(args.seed)
+    packets = session(rng, args.strokes)
+    ok = run_peer(args, rng, packets) if args.peer else \
+        run_pty(args, rng, packets)
+    if not ok:
+        sys.exit('FAIL')
+    print('PASS')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Fake I2C adapter with a Wacom EMR controller on it, for testing the
+ * polling and runtime PM paths of wacom_i2c without hardware.
+ *
+ * The adapter answers the pen query with a G9 controller and every read
+ * with a pen report, in proximity or not as the "prox" parameter says.
+ * The controller is registered without an interrupt, so wacom_i2c polls
+ * it. Reads and SET_POWER requests are counted in read-only parameters.
+ */
+
+#include <linux/module.h>
+#include <linux/i2c.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#define FAKE_ADDR		0x0a
+
+#define WACOM_COMMAND_LSB	0x04
+#define OPCODE_GET_REPORT	0x02
+#define OPCODE_SET_POWER	0x08
+#define POWER_SLEEP		0x01
+#define WACOM_QUERY_SIZE	22
+#define PEN_REPORT_LEN		10
+#define WACOM_IN_PROXIMITY	0x20
+
+static bool prox;
+module_param(prox, bool, 0644);
+MODULE_PARM_DESC(prox, " report the pen in proximity");
+
+static unsigned int reads;
+module_param(reads, uint, 0444);
+MODULE_PARM_DESC(reads, " pen reports read");
+
+static unsigned int reads_asleep;
+module_param(reads_asleep, uint, 0444);
+MODULE_PARM_DESC(reads_asleep, " pen reports read while put to sleep");
+
+static unsigned int power_sleep;
+module_param(power_sleep, uint, 0444);
+MODULE_PARM_DESC(power_sleep, " SET_POWER sleep requests");
+
+static unsigned int power_on;
+module_param(power_on, uint, 0444);
+MODULE_PARM_DESC(power_on, " SET_POWER on requests");
+
+static bool asleep;
+static u16 pos;
+
+static void fake_put16(u8 *buf, u16 value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = value >> 8;
+}
+
+static void fake_query(u8 *buf, u16 len)
+{
+	u8 data[WACOM_QUERY_SIZE] = { 0 };
+
+	fake_put16(&data[3], 20000);	/* x_max */
+	fake_put16(&data[5], 12500);	/* y_max */
+	fake_put16(&data[11], 2047);	/* pressure_max */
+	fake_put16(&data[13], 0x10);	/* fw_version */
+	/* no distance or tilt: a G9 controller */
+
+	memcpy(buf, data, min_t(u16, len, sizeof(data)));
+}
+
+static void fake_report(u8 *buf, u16 len)
+{
+	u8 data[PEN_REPORT_LEN] = { PEN_REPORT_LEN };
+
+	reads++;
+	if (asleep)
+		reads_asleep++;
+
+	if (READ_ONCE(prox)) {
+		pos += 7;
+		data[3] = WACOM_IN_PROXIMITY;
+		fake_put16(&data[4], pos % 20000);
+		fake_put16(&data[6], pos % 12500);
+	} else {
+		/* an idle controller answers with an empty report */
+		data[0] = 0;
+	}
+
+	memset(buf, 0, len);
+	memcpy(buf, data, min_t(u16, len, sizeof(data)));
+}
+
+static int fake_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+	struct i2c_msg *cmd = &msgs[0];
+
+	if (cmd->addr != FAKE_ADDR)
+		return -ENXIO;
+
+	/* command write followed by the feature read: the pen query */
+	if (num == 2 && !(cmd->flags & I2C_M_RD) && cmd->len >= 4 &&
+	    cmd->buf[3] == OPCODE_GET_REPORT &&
+	    (msgs[1].flags & I2C_M_RD)) {
+		fake_query(msgs[1].buf, msgs[1].len);
+		return num;
+	}
+
+	if (num != 1)
+		return -EOPNOTSUPP;
+
+	if (cmd->flags & I2C_M_RD) {
+		fake_report(cmd->buf, cmd->len);
+		return num;
+	}
+
+	if (cmd->len == 4 && cmd->buf[0] == WACOM_COMMAND_LSB &&
+	    cmd->buf[3] == OPCODE_SET_POWER) {
+		asleep = cmd->buf[2] == POWER_SLEEP;
+		if (asleep)
+			power_sleep++;
+		else
+			power_on++;
+		return num;
+	}
+
+	return -EOPNOTSUPP;
+}
+
+static u32 fake_functionality(struct i2c_adapter *adap)
+{
+	return I2C_FUNC_I2C;
+}
+
+static const struct i2c_algorithm fake_algorithm = {
+	.master_xfer	= fake_xfer,
+	.functionality	= fake_functionality,
+};
+
+static struct i2c_adapter fake_adapter = {
+	.owner		= THIS_MODULE,
+	.class		= I2C_CLASS_HWMON,
+	.algo		= &fake_algorithm,
+	.name		= "wacom_i2c_fake",
+};
+
+static struct i2c_client *fake_client;
+
+static int __init wacom_i2c_fake_init(void)
+{
+	struct i2c_board_info info = {
+		I2C_BOARD_INFO("WAC_I2C_EMR", FAKE_ADDR),
+		/* no interrupt: wacom_i2c has to poll */
+		.irq = 0,
+	};
+	int error;
+
+	error = i2c_add_adapter(&fake_adapter);
+	if (error)
+		return error;
+
+	fake_client = i2c_new_client_device(&fake_adapter, &info);
+	if (IS_ERR(fake_client)) {
+		i2c_del_adapter(&fake_adapter);
+		return PTR_ERR(fake_client);
+	}
+
+	return 0;
+}
+
+static void __exit wacom_i2c_fake_exit(void)
+{
+	i2c_unregister_device(fake_client);
+	i2c_del_adapter(&fake_adapter);
+}
+
+module_init(wacom_i2c_fake_init);
+module_exit(wacom_i2c_fake_exit);
+
+MODULE_DESCRIPTION("Fake I2C Wacom EMR controller for testing wacom_i2c");
+MODULE_LICENSE("GPL");
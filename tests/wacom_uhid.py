@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+#
+# Helpers for driving the wacom driver from userspace: uhid stand-in
+# devices and a small evdev reader. Needs root, /dev/uhid and the
+# driver under test loaded.
+
+import glob
+import os
+import select
+import struct
+import threading
+import time
+
+UHID_DESTROY = 1
+UHID_START = 2
+UHID_OUTPUT = 6
+UHID_GET_REPORT = 9
+UHID_GET_REPORT_REPLY = 10
+UHID_CREATE2 = 11
+UHID_INPUT2 = 12
+UHID_SET_REPORT = 13
+UHID_SET_REPORT_REPLY = 14
+
+UHID_DATA_MAX = 4096
+# __u32 type plus the largest member, struct uhid_create2_req
+UHID_EVENT_SIZE = 4 + 128 + 64 + 64 + 2 + 2 + 4 * 4 + UHID_DATA_MAX
+
+BUS_USB = 0x03
+VENDOR_WACOM = 0x056a
+EIO = 5
+
+EV_SYN = 0x00
+EV_KEY = 0x01
+EV_ABS = 0x03
+SYN_REPORT = 0
+BTN_TOOL_PEN = 0x140
+BTN_TOUCH = 0x14a
+
+INPUT_EVENT = struct.Struct('llHHi')
+
+
+class UHidDevice:
+    """A uhid device that answers feature requests like a tablet would.
+
+    Feature reports are answered from @features, indexed by report id.
+    A SET_REPORT stores its data there, so reading a feature back
+    returns what was last written, and is logged in set_reports along
+    with the time it arrived. @set_delay adds a delay to every
+    SET_REPORT to stand in for a USB control transfer.
+    """
+
+    def __init__(self, name, product, rdesc, phys='', uniq='',
+                 vendor=VENDOR_WACOM, bus=BUS_USB, features=None,
+                 set_delay=0.0):
+        self.name = name
+        self.phys = phys
+        self.features = dict(features or {})
+        self.set_delay = set_delay
+        self.set_reports = []
+        self.outputs = []
+        self.started = threading.Event()
+        self.stop = False
+
+        self.fd = os.open('/dev/uhid', os.O_RDWR | os.O_CLOEXEC)
+        self._write(UHID_CREATE2, struct.pack(
+            '<128s64s64sHHIIII', name.encode(), phys.encode(),
+            uniq.encode(), len(rdesc), bus, vendor, product, 0, 0) + rdesc)
+
+        self.thread = threading.Thread(target=self._serve, daemon=True)
+        self.thread.start()
+        if not self.started.wait(5):
+            raise RuntimeError('%s: uhid device did not start' % name)
+
+    def _write(self, kind, payload):
+        buf = struct.pack('<I', kind) + payload
+        os.write(self.fd, buf + bytes(UHID_EVENT_SIZE - len(buf)))
+
+    def _serve(self):
+        while not self.stop:
+            ready, _, _ = select.select([self.fd], [], [], 0.1)
+            if not ready:
+                continue
+            try:
+                ev = os.read(self.fd, UHID_EVENT_SIZE)
+            except OSError:
+                return
+
+            kind, = struct.unpack_from('<I', ev)
+            if kind == UHID_START:
+                self.started.set()
+            elif kind == UHID_GET_REPORT:
+                req, rnum, _ = struct.unpack_from('<IBB', ev, 4)
+                data = self.features.get(rnum, b'')
+                self._write(UHID_GET_REPORT_REPLY, struct.pack(
+                    '<IHH', req, 0 if data else EIO, len(data)) + data)
+            elif kind == UHID_SET_REPORT:
+                req, rnum, _, size = struct.unpack_from('<IBBH', ev, 4)
+                data = ev[12:12 + size]
+                self.set_reports.append((time.monotonic(), rnum, data))
+                self.features[rnum] = data
+                if self.set_delay:
+                    time.sleep(self.set_delay)
+                self._write(UHID_SET_REPORT_REPLY,
+                            struct.pack('<IH', req, 0))
+            elif kind == UHID_OUTPUT:
+                size, = struct.unpack_from('<H', ev, 4 + UHID_DATA_MAX)
+                self.outputs.append((time.monotonic(), ev[4:4 + size]))
+
+    def input(self, data):
+        """Send one input report; the driver handles it before we return."""
+        self._write(UHID_INPUT2, struct.pack('<H', len(data)) + data)
+
+    def sysfs(self, timeout=5):
+        """The HID device's sysfs directory, once the wacom driver bound."""
+        end = time.time() + timeout
+        while time.time() < end:
+            for path in glob.glob('/sys/bus/hid/devices/*'):
+                try:
+                    with open(os.path.join(path, 'uevent')) as f:
+                        uevent = f.read()
+                except OSError:
+                    continue
+                if ('HID_NAME=%s\n' % self.name in uevent and
+                        'HID_PHYS=%s\n' % self.phys in uevent and
+                        os.path.basename(os.path.realpath(
+                            os.path.join(path, 'driver'))) == 'wacom'):
+                    return path
+            time.sleep(0.1)
+        raise RuntimeError('%s: not bound to the wacom driver' % self.name)
+
+    def evdev(self, suffix, timeout=5):
+        """The event node of the input device whose name ends in suffix."""
+        hid = self.sysfs(timeout)
+        end = time.time() + timeout
+        while time.time() < end:
+            for node in glob.glob(os.path.join(hid, 'input', 'input*')):
+                with open(os.path.join(node, 'name')) as f:
+                    if not f.read().strip().endswith(suffix):
+                        continue
+                events = glob.glob(os.path.join(node, 'event*'))
+                if events:
+                    return '/dev/input/' + os.path.basename(events[0])
+            time.sleep(0.1)
+        raise RuntimeError('%s: no%s input device' % (self.name, suffix))
+
+    def destroy(self):
+        self.stop = True
+        self.thread.join()
+        self._write(UHID_DESTROY, b'')
+        os.close(self.fd)
+
+
+class Evdev:
+    """Collects the frames of an event node from a background thread."""
+
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDONLY | os.O_NONBLOCK)
+        self.frames = []
+        self.stop = False
+        self.thread = threading.Thread(target=self._read, daemon=True)
+        self.thread.start()
+
+    def _read(self):
+        frame = []
+        while not self.stop:
+            ready, _, _ = select.select([self.fd], [], [], 0.1)
+            if not ready:
+                continue
+            try:
+                buf = os.read(self.fd, INPUT_EVENT.size * 64)
+            except BlockingIOError:
+                continue
+            for off in range(0, len(buf), INPUT_EVENT.size):
+                sec, usec, kind, code, value = \
+                    INPUT_EVENT.unpack_from(buf, off)
+                if kind == EV_SYN and code == SYN_REPORT:
+                    self.frames.append((sec + usec / 1e6, frame))
+                    frame = []
+                else:
+                    frame.append((kind, code, value))
+
+    def close(self):
+        # let the last frames drain
+        time.sleep(0.2)
+        self.stop = True
+        self.thread.join()
+        os.close(self.fd)
+        return self.frames
+
+
+def key_intervals(frames, code):
+    """(start, end) times during which key @code was reported down."""
+    intervals = []
+    start = None
+    for t, frame in frames:
+        for kind, c, value in frame:
+            if kind != EV_KEY or c != code:
+                continue
+            if value and start is None:
+                start = t
+            elif not value and start is not None:
+                intervals.append((start, t))
+                start = None
+    if start is not None:
+        intervals.append((start, float('inf')))
+    return intervals
+
+
+def debugfs(hid_sysfs, name):
+    """Read one of the driver's per-device debugfs counters."""
+    path = os.path.join('/sys/kernel/debug/wacom',
+                        os.path.basename(hid_sysfs), name)
+    with open(path) as f:
+        return int(f.read())